@@ -0,0 +1,77 @@
+#!/bin/sh
+
+# Compare cold-cache `ls -l` against `ls -l --inode-order` on a directory
+# whose name order has nothing to do with its inode order.
+#
+# Caches must be dropped between runs for the numbers to mean anything.
+# On Linux this is done through /proc/sys/vm/drop_caches and needs root;
+# elsewhere set DROP_CACHES to a command that does the equivalent (e.g.
+# unmounting and remounting the test file system).
+#
+# usage: inode_order.sh [dir] [files] [runs]
+#
+# LS_BIN overrides the binary under test, by default ../bin/ls.
+
+MY_LS=${LS_BIN:-`readlink -f ../bin/ls`}
+
+DIR=${1:-/tmp/ls_inode_bench}
+FILES=${2:-20000}
+RUNS=${3:-5}
+
+if [ -z "${DROP_CACHES}" ]; then
+	DROP_CACHES="sync; echo 3 > /proc/sys/vm/drop_caches"
+fi
+
+if [ ! -d "${DIR}" ]; then
+	echo "Populating ${DIR} with ${FILES} files"
+	mkdir -p "${DIR}"
+	i=0
+	while [ ${i} -lt ${FILES} ]; do
+		touch "${DIR}/tmp${i}"
+		i=$((i + 1))
+	done
+
+	# rename everything to random names so readdir and name order
+	# both scatter across the inode table
+	i=0
+	while [ ${i} -lt ${FILES} ]; do
+		mv "${DIR}/tmp${i}" "${DIR}/`od -An -N6 -tx1 /dev/urandom | \
+		    tr -d ' \n'`"
+		i=$((i + 1))
+	done
+fi
+
+# a warm run would be meaningless, so give up rather than report one
+drop_caches()
+{
+	if ! sh -c "${DROP_CACHES}"; then
+		echo "cannot drop caches: run as root or set DROP_CACHES" >&2
+		exit 1
+	fi
+}
+
+# runs in a subshell, so failures come back as the exit status
+timed_run()
+{
+	START=`date +%s.%N`
+	${MY_LS} ${1} "${DIR}" > /dev/null || return 1
+	END=`date +%s.%N`
+	awk "BEGIN { print ${END} - ${START} }"
+}
+
+for mode in "-l" "-l --inode-order" "-l --inode-order=readahead"
+do
+	TOTAL=0
+	run=0
+	while [ ${run} -lt ${RUNS} ]; do
+		drop_caches
+		if ! T=`timed_run "${mode}"`; then
+			echo "${MY_LS} ${mode} failed" >&2
+			exit 1
+		fi
+		TOTAL=`awk "BEGIN { print ${TOTAL} + ${T} }"`
+		run=$((run + 1))
+	done
+	awk "BEGIN { printf(\"ls ${mode}: %.4fs mean over ${RUNS} cold runs\\n\", \
+	    ${TOTAL} / ${RUNS}) }"
+done
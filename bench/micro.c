@@ -0,0 +1,403 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+/*
+ * Microbenchmarks for the per-entry kernels of print.c and helpers.c:
+ * the sort comparators under qsort, size and time formatting, name
+ * escaping, owner lookup and strmode. Everything runs on synthetic
+ * in-memory entries and writes to /dev/null, so the numbers reflect
+ * the code rather than the filesystem.
+ *
+ * The kernels are reached through internal.h and linked from the same
+ * objects as ls itself. Cycles and instructions come from
+ * perf_event_open where Linux allows it, and are left out otherwise.
+ *
+ * usage: micro [iterations]
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include <fts.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../helpers.h"
+#include "../internal.h"
+
+#define BENCH_ENTRIES 4096
+#define BENCH_ITERATIONS 200000
+#define BENCH_NAME_LEN 24
+
+enum Counter {
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTERS
+};
+
+typedef struct Bench {
+	const char *name;
+	void (*run)(long);
+	long ops_per_run;	/* entries handled by one call of run() */
+} Bench;
+
+static FTSENT *entries[BENCH_ENTRIES];
+static FTSENT *work[BENCH_ENTRIES];
+static struct stat stats[BENCH_ENTRIES];
+static Options bench_options;
+static FILE *null_out = NULL;
+static volatile unsigned long sink_value = 0;	/* defeat dead code removal */
+static int counter_fds[COUNTERS] = {-1, -1};
+
+#ifdef __linux__
+static int
+openCounter(unsigned long config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static void
+openCounters(void)
+{
+#ifdef __linux__
+	counter_fds[COUNTER_CYCLES] = openCounter(PERF_COUNT_HW_CPU_CYCLES);
+	counter_fds[COUNTER_INSTRUCTIONS] = 
+	    openCounter(PERF_COUNT_HW_INSTRUCTIONS);
+#endif
+}
+
+static void
+startCounters(void)
+{
+#ifdef __linux__
+	int i = 0;
+
+	for (i = 0; i < COUNTERS; i++) {
+		if (counter_fds[i] != -1) {
+			(void)ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+			(void)ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+#endif
+}
+
+/* counts since startCounters(), or -1 where a counter is missing */
+static void
+stopCounters(double *counts)
+{
+	int i = 0;
+#ifdef __linux__
+	uint64_t value = 0;
+#endif
+
+	for (i = 0; i < COUNTERS; i++) {
+		counts[i] = -1.0;
+#ifdef __linux__
+		if (counter_fds[i] != -1) {
+			(void)ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+			if (read(counter_fds[i], &value, sizeof(value)) == 
+			    (ssize_t)sizeof(value)) {
+				counts[i] = (double)value;
+			}
+		}
+#endif
+	}
+}
+
+/* a spread of names, sizes and times, in no particular order */
+static int
+makeEntries(void)
+{
+	static const char *stems[] = {
+		"Makefile", "README", "main", "util", "a.out", "data",
+		".profile", "core", "notes\tdraft", "x"
+	};
+	const size_t nstems = sizeof(stems) / sizeof(stems[0]);
+	char name[BENCH_NAME_LEN];
+	size_t len = 0;
+	int i = 0;
+
+	for (i = 0; i < BENCH_ENTRIES; i++) {
+		len = (size_t)snprintf(name, sizeof(name), "%s%d", 
+		    stems[(size_t)i % nstems], (i * 7919) % BENCH_ENTRIES);
+
+		if ((entries[i] = calloc(1, sizeof(FTSENT) + len + 1)) == NULL) {
+			return -1;
+		}
+
+		memcpy(entries[i]->fts_name, name, len + 1);
+		entries[i]->fts_namelen = len;
+		entries[i]->fts_info = FTS_F;
+		entries[i]->fts_statp = &stats[i];
+
+		stats[i].st_mode = (i % 5 == 0 ? S_IFDIR : S_IFREG) | 
+		    (i % 3 == 0 ? 0755 : 0644);
+		stats[i].st_size = (off_t)(((unsigned long)i * 2654435761UL) % 
+		    (1UL << (i % 31)) + 1);
+		stats[i].st_mtime = (time_t)(1600000000L + (i * 104729L) % 
+		    (400L * 86400L));
+		stats[i].st_atime = stats[i].st_mtime;
+		stats[i].st_ctime = stats[i].st_mtime;
+		stats[i].st_uid = i % 2 == 0 ? 0 : getuid();
+		stats[i].st_gid = i % 2 == 0 ? 0 : getgid();
+		stats[i].st_nlink = 1;
+	}
+
+	return 0;
+}
+
+static int
+qsortName(const void *first, const void *second)
+{
+	return nameComp((const FTSENT **)first, (const FTSENT **)second);
+}
+
+static int
+qsortSize(const void *first, const void *second)
+{
+	return sizeComp((const FTSENT **)first, (const FTSENT **)second);
+}
+
+static int
+qsortMtime(const void *first, const void *second)
+{
+	return mtimeComp((const FTSENT **)first, (const FTSENT **)second);
+}
+
+/* every sort starts again from the same unsorted order */
+static void
+sortWith(int (*comp)(const void *, const void *), long runs)
+{
+	long r = 0;
+
+	for (r = 0; r < runs; r++) {
+		memcpy(work, entries, sizeof(work));
+		qsort(work, BENCH_ENTRIES, sizeof(work[0]), comp);
+		sink_value += (unsigned long)work[0]->fts_namelen;
+	}
+}
+
+static void
+benchNameSort(long runs)
+{
+	sortWith(qsortName, runs);
+}
+
+static void
+benchSizeSort(long runs)
+{
+	sortWith(qsortSize, runs);
+}
+
+static void
+benchMtimeSort(long runs)
+{
+	sortWith(qsortMtime, runs);
+}
+
+static void
+benchHumanReadable(long runs)
+{
+	char buf[FIELD_LEN];
+	long r = 0;
+
+	for (r = 0; r < runs; r++) {
+		formatHumanReadable(buf, sizeof(buf), (uint64_t)
+		    stats[r % BENCH_ENTRIES].st_size);
+		sink_value += (unsigned long)buf[0];
+	}
+}
+
+static void
+benchFileTime(long runs)
+{
+	long r = 0;
+
+	for (r = 0; r < runs; r++) {
+		printFileTime(null_out, &stats[r % BENCH_ENTRIES], 
+		    &bench_options);
+	}
+}
+
+static void
+benchModifiedName(long runs)
+{
+	char *name = NULL;
+	long r = 0;
+
+	for (r = 0; r < runs; r++) {
+		name = getModifiedName(entries[r % BENCH_ENTRIES]->fts_name, 
+		    &bench_options);
+		sink_value += name != NULL ? (unsigned long)name[0] : 0;
+		free(name);
+	}
+}
+
+static void
+benchUserAndGroup(long runs)
+{
+	EntryFields fields;
+	long r = 0;
+
+	for (r = 0; r < runs; r++) {
+		formatUserAndGroup(&fields, &stats[r % BENCH_ENTRIES]);
+		sink_value += (unsigned long)fields.user[0];
+	}
+}
+
+static void
+benchStrmode(long runs)
+{
+	char fmode[STRMODE_LEN];
+	long r = 0;
+
+	for (r = 0; r < runs; r++) {
+		strmode(stats[r % BENCH_ENTRIES].st_mode, fmode);
+		sink_value += (unsigned long)fmode[0];
+	}
+}
+
+static double
+elapsedNsec(const struct timespec *start, const struct timespec *end)
+{
+	return (double)(end->tv_sec - start->tv_sec) * NSEC_PER_SEC +
+	    (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static void
+runBench(const Bench *bench, long iterations)
+{
+	struct timespec start;
+	struct timespec end;
+	double counts[COUNTERS];
+	double ops = 0.0;
+	long runs = iterations / bench->ops_per_run;
+
+	if (runs < 1) {
+		runs = 1;
+	}
+	ops = (double)runs * bench->ops_per_run;
+
+	/* one untimed pass to fill caches, the id cache included */
+	bench->run(1);
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	startCounters();
+	bench->run(runs);
+	stopCounters(counts);
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%-20s %10.1f", bench->name, elapsedNsec(&start, &end) / ops);
+	if (counts[COUNTER_CYCLES] >= 0) {
+		printf(" %10.1f", counts[COUNTER_CYCLES] / ops);
+	} else {
+		printf(" %10s", "-");
+	}
+	if (counts[COUNTER_INSTRUCTIONS] >= 0) {
+		printf(" %10.1f", counts[COUNTER_INSTRUCTIONS] / ops);
+	} else {
+		printf(" %10s", "-");
+	}
+	printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	static const Bench benches[] = {
+		{"nameComp qsort", benchNameSort, BENCH_ENTRIES},
+		{"sizeComp qsort", benchSizeSort, BENCH_ENTRIES},
+		{"mtimeComp qsort", benchMtimeSort, BENCH_ENTRIES},
+		{"formatHumanReadable", benchHumanReadable, 1},
+		{"printFileTime", benchFileTime, 1},
+		{"getModifiedName", benchModifiedName, 1},
+		{"formatUserAndGroup", benchUserAndGroup, 1},
+		{"strmode", benchStrmode, 1}
+	};
+	const size_t nbenches = sizeof(benches) / sizeof(benches[0]);
+	long iterations = BENCH_ITERATIONS;
+	size_t i = 0;
+
+	setprogname(argv[0]);
+	tzset();
+
+	if (argc > 1 && (iterations = atol(argv[1])) <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", getprogname());
+		return EXIT_FAILURE;
+	}
+
+	if ((null_out = fopen("/dev/null", "w")) == NULL) {
+		perror("/dev/null");
+		return EXIT_FAILURE;
+	}
+
+	if (makeEntries() != 0) {
+		perror("entries");
+		return EXIT_FAILURE;
+	}
+
+	setDefaultOptions(&bench_options);
+	bench_options.mark_nonprinting = 1;
+	openCounters();
+
+	printf("%-20s %10s %10s %10s\n", "kernel", "ns/op", "cycles/op", 
+	    "instrs/op");
+	for (i = 0; i < nbenches; i++) {
+		runBench(&benches[i], iterations);
+	}
+
+	(void)fclose(null_out);
+
+	return EXIT_SUCCESS;
+}
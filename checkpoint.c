@@ -0,0 +1,331 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+/*
+ * Checkpoints for long recursive listings. A checkpoint names the next
+ * entry the traversal will process, as the chain of names from its
+ * operand down, together with the output offset reached by everything
+ * before it. Resuming truncates the output back to that offset and
+ * replays the walk silently, skipping without reading any directory
+ * that comes before the cursor, until the cursor entry comes up.
+ *
+ * The file is written to a temporary name, synced and renamed over the
+ * old one, so a crash leaves either the previous checkpoint or the new.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "internal.h"
+
+#define CHECKPOINT_MAGIC 0x6c735243	/* "lsRC" */
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_SECS 10		/* between saves */
+#define TMP_SUFFIX ".tmp"
+
+typedef struct CheckpointHeader {
+	uint32_t magic;
+	uint32_t version;
+	int64_t offset;
+	int32_t curr_level;
+	uint32_t depth;
+	uint64_t names_len;	/* NUL-terminated names follow */
+} CheckpointHeader;
+
+int
+initCheckpoint(Checkpoint *cp, const char *path)
+{
+	memset(cp, 0, sizeof(*cp));
+	cp->path = path;
+	(void)clock_gettime(CLOCK_MONOTONIC, &cp->saved);
+
+	if ((cp->dir_fd = open(".", O_RDONLY | O_DIRECTORY)) == -1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+freeCheckpoint(Checkpoint *cp)
+{
+	free(cp->names);
+	free(cp->components);
+	cp->names = NULL;
+	cp->components = NULL;
+	cp->depth = 0;
+
+	if (cp->dir_fd != -1) {
+		(void)close(cp->dir_fd);
+		cp->dir_fd = -1;
+	}
+}
+
+static int
+readCheckpoint(int dir_fd, const char *path, CheckpointHeader *header,
+		char **names)
+{
+	FILE *in = NULL;
+	int fd = -1;
+	int status = 0;
+
+	*names = NULL;
+
+	if ((fd = openat(dir_fd, path, O_RDONLY)) == -1) {
+		return -1;
+	}
+
+	if ((in = fdopen(fd, "rb")) == NULL) {
+		(void)close(fd);
+		return -1;
+	}
+
+	if (fread(header, sizeof(*header), 1, in) != 1 ||
+	    header->magic != CHECKPOINT_MAGIC || 
+	    header->version != CHECKPOINT_VERSION ||
+	    header->offset < 0 || header->depth == 0 || 
+	    header->names_len == 0 || header->names_len > SIZE_MAX / 2) {
+		errno = EINVAL;
+		status = -1;
+	} else if ((*names = malloc(header->names_len)) == NULL) {
+		status = -1;
+	} else if (fread(*names, 1, header->names_len, in) != 
+	    header->names_len || (*names)[header->names_len - 1] != '\0') {
+		errno = EINVAL;
+		status = -1;
+	}
+
+	(void)fclose(in);
+
+	if (status != 0) {
+		free(*names);
+		*names = NULL;
+	}
+
+	return status;
+}
+
+/* read the cursor back; returns 0, or -1 with errno set */
+int
+loadCheckpoint(Checkpoint *cp)
+{
+	CheckpointHeader header;
+	char *name = NULL;
+	size_t i = 0;
+
+	if (readCheckpoint(cp->dir_fd, cp->path, &header, &cp->names) != 0) {
+		return -1;
+	}
+
+	if ((cp->components = calloc(header.depth, 
+	    sizeof(*cp->components))) == NULL) {
+		return -1;
+	}
+
+	name = cp->names;
+	for (i = 0; i < header.depth; i++) {
+		if (name >= cp->names + header.names_len) {
+			errno = EINVAL;
+			return -1;
+		}
+		cp->components[i] = name;
+		name += strlen(name) + 1;
+	}
+
+	cp->depth = header.depth;
+	cp->offset = (off_t)header.offset;
+	cp->curr_level = (short)header.curr_level;
+
+	return 0;
+}
+
+int
+checkpointDue(const Checkpoint *cp)
+{
+	struct timespec now;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec - cp->saved.tv_sec >= CHECKPOINT_SECS;
+}
+
+/* 
+ * Record cursor as the next entry to process, once the output up to
+ * offset is on disk. Returns 0, or -1 with errno set.
+ */
+int
+saveCheckpoint(Checkpoint *cp, const FTSENT *cursor, short curr_level,
+		off_t offset)
+{
+	CheckpointHeader header;
+	const FTSENT *ent = NULL;
+	char tmp_path[PATH_MAX];
+	uint64_t names_len = 0;
+	uint32_t level = 0;
+	uint32_t up = 0;
+	int fd = -1;
+	int saved_errno = 0;
+	int status = 0;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = CHECKPOINT_MAGIC;
+	header.version = CHECKPOINT_VERSION;
+	header.offset = (int64_t)offset;
+	header.curr_level = curr_level;
+
+	for (ent = cursor; ent->fts_level >= FTS_ROOTLEVEL; 
+	    ent = ent->fts_parent) {
+		names_len += ent->fts_namelen + 1;
+		++header.depth;
+	}
+	header.names_len = names_len;
+
+	if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s%s", cp->path, 
+	    TMP_SUFFIX) >= sizeof(tmp_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if ((fd = openat(cp->dir_fd, tmp_path, 
+	    O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		return -1;
+	}
+
+	if (writeFully(fd, &header, sizeof(header)) != 0) {
+		status = -1;
+	}
+
+	/* the chain runs leaf to root, so write it out root first */
+	for (level = 0; status == 0 && level < header.depth; level++) {
+		ent = cursor;
+		for (up = level + 1; up < header.depth; up++) {
+			ent = ent->fts_parent;
+		}
+		if (writeFully(fd, ent->fts_name, ent->fts_namelen + 1) != 0) {
+			status = -1;
+		}
+	}
+
+	if (status == 0 && fsync(fd) != 0) {
+		status = -1;
+	}
+
+	saved_errno = errno;
+	if (close(fd) != 0 && status == 0) {
+		saved_errno = errno;
+		status = -1;
+	}
+
+	if (status == 0 && 
+	    renameat(cp->dir_fd, tmp_path, cp->dir_fd, cp->path) != 0) {
+		saved_errno = errno;
+		status = -1;
+	}
+
+	if (status != 0) {
+		(void)unlinkat(cp->dir_fd, tmp_path, 0);
+		errno = saved_errno;
+		return -1;
+	}
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &cp->saved);
+
+	return 0;
+}
+
+/* a finished listing leaves nothing to resume */
+int
+removeCheckpoint(Checkpoint *cp)
+{
+	if (unlinkat(cp->dir_fd, cp->path, 0) != 0 && errno != ENOENT) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* 
+ * Checkpoint offsets only mean something in a regular file. On resume,
+ * also cut the output back to where the checkpoint left it, dropping
+ * anything written after the last save; opened for appending, later
+ * writes then land at the end.
+ */
+int
+prepareOutput(const char *path, int resume, FILE *out)
+{
+	CheckpointHeader header;
+	char *names = NULL;
+	struct stat sb;
+
+	if (fflush(out) != 0 || fstat(fileno(out), &sb) != 0) {
+		return -1;
+	}
+
+	if (!S_ISREG(sb.st_mode)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!resume) {
+		return 0;
+	}
+
+	if (readCheckpoint(AT_FDCWD, path, &header, &names) != 0) {
+		return -1;
+	}
+	free(names);
+
+	if (sb.st_size < (off_t)header.offset) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ftruncate(fileno(out), (off_t)header.offset) != 0 ||
+	    fseeko(out, (off_t)header.offset, SEEK_SET) != 0) {
+		return -1;
+	}
+
+	return 0;
+}
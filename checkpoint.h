@@ -0,0 +1,66 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef LS_CHECKPOINT_H
+#define LS_CHECKPOINT_H
+
+#include <sys/types.h>
+
+#include <fts.h>
+#include <stdio.h>
+#include <time.h>
+
+/* 
+ * Where a recursive listing had got to: the name at each level down to
+ * the next entry to process, and how much output was already written.
+ */
+typedef struct Checkpoint {
+	const char *path;
+	int dir_fd;		/* resolves path however fts has moved */
+	off_t offset;
+	short curr_level;
+	char *names;
+	char **components;
+	size_t depth;
+	struct timespec saved;
+} Checkpoint;
+
+int initCheckpoint(Checkpoint *, const char *);
+int loadCheckpoint(Checkpoint *);
+int checkpointDue(const Checkpoint *);
+int saveCheckpoint(Checkpoint *, const FTSENT *, short, off_t);
+int removeCheckpoint(Checkpoint *);
+void freeCheckpoint(Checkpoint *);
+int prepareOutput(const char *, int, FILE *);
+
+#endif /* LS_CHECKPOINT_H */
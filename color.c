@@ -0,0 +1,383 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+/*
+ * LS_COLORS support. The specification is compiled once into a table
+ * of escape sequences indexed by file type, plus a perfect hash of the
+ * "*.ext" patterns, so that choosing a color costs one hash and one
+ * key comparison per entry rather than a scan over every pattern.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <fts.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "color.h"
+
+#define EXT_MAX_LEN 32
+#define SEED_TRIES 256
+#define SLOTS_MIN 8
+#define SLOTS_MAX (1UL << 20)
+
+/* roughly the GNU defaults, used when LS_COLORS is unset */
+static const char *default_colors = 
+	"di=01;34:ln=01;36:so=01;35:pi=40;33:bd=40;33;01:cd=40;33;01:"
+	"or=40;31;01:ex=01;32:su=37;41:sg=30;43:tw=30;42:ow=34;42:st=37;44";
+
+enum ColorType {
+	COLOR_FILE,
+	COLOR_DIR,
+	COLOR_LINK,
+	COLOR_ORPHAN,
+	COLOR_FIFO,
+	COLOR_SOCK,
+	COLOR_BLK,
+	COLOR_CHR,
+	COLOR_EXEC,
+	COLOR_SETUID,
+	COLOR_SETGID,
+	COLOR_STICKY,
+	COLOR_OTHER_WRITABLE,
+	COLOR_STICKY_OTHER_WRITABLE,
+	COLOR_TYPES
+};
+
+static const char *type_keys[COLOR_TYPES] = {
+	"fi", "di", "ln", "or", "pi", "so", "bd", "cd", "ex", "su", "sg",
+	"st", "ow", "tw"
+};
+
+typedef struct ExtSlot {
+	const char *ext;	/* lowercased, NULL if the slot is empty */
+	const char *seq;
+} ExtSlot;
+
+typedef struct ColorTable {
+	const char *types[COLOR_TYPES];
+	ExtSlot *slots;
+	size_t nslots;
+	unsigned long seed;
+	char *arena;
+	char *spec;
+} ColorTable;
+
+static ColorTable colors;
+
+static unsigned long
+hashExt(unsigned long seed, const char *ext, size_t len)
+{
+	unsigned long hash = 2166136261UL ^ seed;
+	size_t i = 0;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)tolower((unsigned char)ext[i]);
+		hash = (hash * 16777619UL) & 0xffffffffUL;
+	}
+
+	return hash;
+}
+
+/* 
+ * Search for a seed that gives every distinct extension its own slot,
+ * growing the table when no seed works at the current size.
+ */
+static int
+buildPerfectHash(ExtSlot *keys, size_t nkeys)
+{
+	ExtSlot *slots = NULL;
+	ExtSlot *slot = NULL;
+	size_t nslots = SLOTS_MIN;
+	unsigned long seed = 0;
+	size_t i = 0;
+	int placed = 0;
+
+	while (nslots < nkeys * 2) {
+		nslots *= 2;
+	}
+
+	for (; nslots <= SLOTS_MAX; nslots *= 2) {
+		if ((slots = calloc(nslots, sizeof(*slots))) == NULL) {
+			return -1;
+		}
+
+		for (seed = 0; seed < SEED_TRIES; seed++) {
+			memset(slots, 0, nslots * sizeof(*slots));
+			placed = 1;
+
+			for (i = 0; i < nkeys && placed; i++) {
+				slot = &slots[hashExt(seed, keys[i].ext,
+				    strlen(keys[i].ext)) & (nslots - 1)];
+
+				/* a repeated pattern overrides the earlier one */
+				if (slot->ext == NULL || 
+				    strcmp(slot->ext, keys[i].ext) == 0) {
+					*slot = keys[i];
+				} else {
+					placed = 0;
+				}
+			}
+
+			if (placed) {
+				colors.slots = slots;
+				colors.nslots = nslots;
+				colors.seed = seed;
+				return 0;
+			}
+		}
+
+		free(slots);
+	}
+
+	return -1;
+}
+
+static void
+freeColors(void)
+{
+	free(colors.slots);
+	free(colors.arena);
+	free(colors.spec);
+	memset(&colors, 0, sizeof(colors));
+}
+
+/* copy "\033[<code>m" into the arena and return where it starts */
+static const char *
+addSequence(char **cursor, const char *code)
+{
+	char *seq = *cursor;
+	size_t len = strlen(code);
+
+	if (len == 0) {
+		return NULL;
+	}
+
+	memcpy(seq, "\033[", 2);
+	memcpy(seq + 2, code, len);
+	seq[len + 2] = 'm';
+	seq[len + 3] = '\0';
+	*cursor += len + 4;
+
+	return seq;
+}
+
+/* 
+ * Compile an LS_COLORS string, or the defaults for NULL. Recompiling
+ * the specification already loaded is a no-op, so the server can call
+ * this for every request. Unknown keys and patterns other than "*.ext"
+ * are ignored, as are malformed entries.
+ */
+int
+loadColors(const char *spec)
+{
+	ExtSlot *keys = NULL;
+	size_t nkeys = 0;
+	size_t items = 1;
+	char *work = NULL;
+	char *item = NULL;
+	char *next = NULL;
+	char *value = NULL;
+	char *cursor = NULL;
+	char *ext = NULL;
+	size_t i = 0;
+	int status = 0;
+
+	if (spec == NULL) {
+		spec = default_colors;
+	}
+
+	if (colors.spec != NULL && strcmp(colors.spec, spec) == 0) {
+		return 0;
+	}
+
+	freeColors();
+
+	for (i = 0; spec[i] != '\0'; i++) {
+		if (spec[i] == ':') {
+			++items;
+		}
+	}
+
+	/* every item grows by at most the escape framing and a NUL */
+	colors.spec = strdup(spec);
+	work = strdup(spec);
+	colors.arena = malloc(strlen(spec) * 2 + items * 5 + 1);
+	keys = calloc(items, sizeof(*keys));
+
+	if (colors.spec == NULL || work == NULL || colors.arena == NULL ||
+	    keys == NULL) {
+		status = -1;
+		goto done;
+	}
+
+	cursor = colors.arena;
+
+	for (item = work; item != NULL; item = next) {
+		if ((next = strchr(item, ':')) != NULL) {
+			*next++ = '\0';
+		}
+
+		if ((value = strchr(item, '=')) == NULL) {
+			continue;
+		}
+		*value++ = '\0';
+
+		if (item[0] == '*' && item[1] == '.') {
+			if (strlen(item + 2) == 0 || 
+			    strlen(item + 2) > EXT_MAX_LEN ||
+			    strchr(item + 2, '.') != NULL) {
+				continue;
+			}
+
+			ext = cursor;
+			for (i = 0; item[i + 2] != '\0'; i++) {
+				ext[i] = (char)tolower((unsigned char)item[i + 2]);
+			}
+			ext[i] = '\0';
+			cursor += i + 1;
+
+			if ((keys[nkeys].seq = addSequence(&cursor, value)) != NULL) {
+				keys[nkeys++].ext = ext;
+			}
+			continue;
+		}
+
+		for (i = 0; i < COLOR_TYPES; i++) {
+			if (strcmp(item, type_keys[i]) == 0) {
+				colors.types[i] = addSequence(&cursor, value);
+			}
+		}
+	}
+
+	if (nkeys > 0 && buildPerfectHash(keys, nkeys) != 0) {
+		status = -1;
+	}
+
+done:
+	free(keys);
+	free(work);
+	if (status != 0) {
+		freeColors();
+	}
+
+	return status;
+}
+
+static const char *
+extensionColor(const char *name)
+{
+	const ExtSlot *slot = NULL;
+	const char *ext = strrchr(name, '.');
+	size_t len = 0;
+	size_t i = 0;
+
+	if (colors.nslots == 0 || ext == NULL) {
+		return NULL;
+	}
+
+	++ext;
+	if ((len = strlen(ext)) == 0 || len > EXT_MAX_LEN) {
+		return NULL;
+	}
+
+	slot = &colors.slots[hashExt(colors.seed, ext, len) & 
+	    (colors.nslots - 1)];
+	if (slot->ext == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (slot->ext[i] != tolower((unsigned char)ext[i])) {
+			return NULL;
+		}
+	}
+
+	return slot->ext[len] == '\0' ? slot->seq : NULL;
+}
+
+static const char *
+typeColor(const LsEntry *ent)
+{
+	const mode_t mode = ent->statp->st_mode;
+	const mode_t exec_comp = S_IXUSR | S_IXGRP | S_IXOTH;
+
+	if (S_ISLNK(mode)) {
+		return ent->info == FTS_SLNONE && colors.types[COLOR_ORPHAN] ?
+		    colors.types[COLOR_ORPHAN] : colors.types[COLOR_LINK];
+	} else if (S_ISDIR(mode)) {
+		if ((mode & S_ISVTX) && (mode & S_IWOTH)) {
+			return colors.types[COLOR_STICKY_OTHER_WRITABLE];
+		} else if (mode & S_IWOTH) {
+			return colors.types[COLOR_OTHER_WRITABLE];
+		} else if (mode & S_ISVTX) {
+			return colors.types[COLOR_STICKY];
+		}
+		return colors.types[COLOR_DIR];
+	} else if (S_ISFIFO(mode)) {
+		return colors.types[COLOR_FIFO];
+	} else if (S_ISSOCK(mode)) {
+		return colors.types[COLOR_SOCK];
+	} else if (S_ISBLK(mode)) {
+		return colors.types[COLOR_BLK];
+	} else if (S_ISCHR(mode)) {
+		return colors.types[COLOR_CHR];
+	} else if ((mode & S_ISUID) && colors.types[COLOR_SETUID]) {
+		return colors.types[COLOR_SETUID];
+	} else if ((mode & S_ISGID) && colors.types[COLOR_SETGID]) {
+		return colors.types[COLOR_SETGID];
+	} else if ((mode & exec_comp) && colors.types[COLOR_EXEC]) {
+		return colors.types[COLOR_EXEC];
+	}
+
+	return NULL;
+}
+
+/* escape sequence to start this entry's name with, or NULL for none */
+const char *
+colorFor(const LsEntry *ent)
+{
+	const char *seq = NULL;
+
+	if ((seq = typeColor(ent)) != NULL || !S_ISREG(ent->statp->st_mode)) {
+		return seq;
+	}
+
+	if ((seq = extensionColor(ent->name)) != NULL) {
+		return seq;
+	}
+
+	return colors.types[COLOR_FILE];
+}
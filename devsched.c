@@ -0,0 +1,568 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+/*
+ * Device-aware read-ahead for recursive listings. fts still reads and
+ * stats one directory at a time, in order, and this does not change
+ * that: a hung mount blocks fts_read() all the same. What it does is
+ * hand each directory's subdirectories to a pool of workers that read
+ * and stat them just ahead of fts, so the kernel caches are warm by the
+ * time fts gets there. Each warmed entry is stat'ed twice, once here
+ * and once, from cache, by fts.
+ *
+ * fts walks depth first, so the pending list of each st_dev is a
+ * stack of batches: the children of the directory fts has just entered
+ * go on top, in the order fts will visit them. The window is short,
+ * and when it fills the oldest entries, which fts reaches last, are
+ * dropped, so warmed data is used before the cache can evict it.
+ *
+ * Each device has its own concurrency limit. The limit grows while
+ * per-stat latency stays near the best seen on that device and is
+ * halved when latency climbs, which is what a spinning disk or a
+ * saturated server looks like. Devices that answer from cache are left
+ * alone apart from the odd probe.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "devsched.h"
+#include "helpers.h"
+#include "internal.h"
+
+#define SCHED_WORKERS 8
+#define SCHED_DEVICES 32
+#define SCHED_QUEUE_MAX 64	/* read-ahead window per device */
+#define LIMIT_START 2
+#define LATENCY_SLACK 2		/* tolerated multiple of best latency */
+#define WARM_NSEC 20000		/* stats faster than this hit cache */
+#define PROBE_INTERVAL 64	/* recheck a warm device this often */
+
+typedef struct DeviceQueue {
+	dev_t dev;
+	PathList pending;	/* next for fts at the head */
+	PathNode *batch_end;	/* last entry of the current batch */
+	unsigned long batch;
+	int inflight;
+	int limit;
+	unsigned long ewma_nsec;
+	unsigned long best_nsec;
+	unsigned long skipped;
+} DeviceQueue;
+
+struct DevScheduler {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	DeviceQueue devices[SCHED_DEVICES];
+	size_t ndevices;
+	size_t next_device;
+	size_t nworkers;
+	pthread_t workers[SCHED_WORKERS];
+	unsigned long batch;
+	int base_fd;
+	int warm_flags;
+	int shutdown;
+};
+
+static unsigned long
+elapsedNsec(const struct timespec *start, const struct timespec *end)
+{
+	return (unsigned long)((end->tv_sec - start->tv_sec) * NSEC_PER_SEC +
+	    (end->tv_nsec - start->tv_nsec));
+}
+
+typedef struct DirSlot {
+	ino_t ino;
+	size_t name_off;
+} DirSlot;
+
+static int
+inodeComp(const void *first, const void *second)
+{
+	const DirSlot *s1 = first;
+	const DirSlot *s2 = second;
+
+	if (s1->ino < s2->ino) {
+		return -1;
+	} else if (s1->ino > s2->ino) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static unsigned long
+timedStat(int dir_fd, const char *name)
+{
+	struct stat sb;
+	struct timespec start;
+	struct timespec end;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	(void)fstatat(dir_fd, name, &sb, AT_SYMLINK_NOFOLLOW);
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return elapsedNsec(&start, &end);
+}
+
+static int
+isDotName(const char *name)
+{
+	return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+/* 
+ * Gather d_ino and names from the stream, then stat in ascending inode
+ * order. On ext4/XFS that walks the inode table front to back instead
+ * of seeking around it in hash or name order.
+ */
+static unsigned long
+statByInode(DIR *dirp, int dir_fd, unsigned long *count)
+{
+	struct dirent *dp = NULL;
+	DirSlot *slots = NULL;
+	DirSlot *grown_slots = NULL;
+	char *names = NULL;
+	char *grown_names = NULL;
+	size_t nslots = 0;
+	size_t slot_cap = 0;
+	size_t names_len = 0;
+	size_t names_cap = 0;
+	size_t len = 0;
+	size_t i = 0;
+	unsigned long total = 0;
+
+	while ((dp = readdir(dirp)) != NULL) {
+		if (isDotName(dp->d_name)) {
+			continue;
+		}
+
+		len = strlen(dp->d_name) + 1;
+		if (nslots == slot_cap) {
+			slot_cap = slot_cap == 0 ? 64 : slot_cap * 2;
+			if ((grown_slots = realloc(slots, 
+			    slot_cap * sizeof(*slots))) == NULL) {
+				break;
+			}
+			slots = grown_slots;
+		}
+		if (names_len + len > names_cap) {
+			names_cap = names_cap == 0 ? 4096 : names_cap * 2;
+			if (names_cap < names_len + len) {
+				names_cap = names_len + len;
+			}
+			if ((grown_names = realloc(names, names_cap)) == NULL) {
+				break;
+			}
+			names = grown_names;
+		}
+
+		slots[nslots].ino = dp->d_ino;
+		slots[nslots].name_off = names_len;
+		memcpy(names + names_len, dp->d_name, len);
+		names_len += len;
+		nslots++;
+	}
+
+	qsort(slots, nslots, sizeof(*slots), inodeComp);
+
+	for (i = 0; i < nslots; i++) {
+		total += timedStat(dir_fd, names + slots[i].name_off);
+	}
+	*count = (unsigned long)nslots;
+
+	free(slots);
+	free(names);
+
+	return nslots == 0 ? 0 : total / nslots;
+}
+
+/*
+ * Returns the mean latency of a stat in this directory, 0 if unknown.
+ * If nstats is not NULL, the number of stats made is stored there.
+ */
+unsigned long
+warmDirectory(int base_fd, const char *path, int flags,
+		unsigned long *nstats)
+{
+	DIR *dirp = NULL;
+	struct dirent *dp = NULL;
+	unsigned long total = 0;
+	unsigned long count = 0;
+	int dir_fd = -1;
+
+	if ((dir_fd = openat(base_fd, path, O_RDONLY | O_DIRECTORY)) == -1) {
+		return 0;
+	}
+
+	/* ask for the directory blocks before the stream starts on them */
+	if (flags & WARM_READAHEAD) {
+		(void)posix_fadvise(dir_fd, 0, 0, POSIX_FADV_WILLNEED);
+	}
+
+	if ((dirp = fdopendir(dir_fd)) == NULL) {
+		(void)close(dir_fd);
+		return 0;
+	}
+
+	if (flags & WARM_INODE_ORDER) {
+		total = statByInode(dirp, dir_fd, &count);
+		(void)closedir(dirp);
+		if (nstats != NULL) {
+			*nstats = count;
+		}
+		return total;
+	}
+
+	while ((dp = readdir(dirp)) != NULL) {
+		if (isDotName(dp->d_name)) {
+			continue;
+		}
+
+		total += timedStat(dir_fd, dp->d_name);
+		count++;
+	}
+
+	(void)closedir(dirp);
+
+	if (nstats != NULL) {
+		*nstats = count;
+	}
+
+	return count == 0 ? 0 : total / count;
+}
+
+/* AIMD on the device's concurrency, driven by observed stat latency */
+static void
+adjustLimit(DeviceQueue *dq, unsigned long nsec)
+{
+	if (nsec == 0) {
+		return;
+	}
+
+	dq->ewma_nsec = dq->ewma_nsec == 0 ? nsec : 
+	    (dq->ewma_nsec * 7 + nsec) / 8;
+
+	if (dq->best_nsec == 0 || nsec < dq->best_nsec) {
+		dq->best_nsec = nsec;
+	}
+
+	if (dq->ewma_nsec > LATENCY_SLACK * dq->best_nsec) {
+		dq->limit = dq->limit > 1 ? dq->limit / 2 : 1;
+		/* let the baseline creep up so a slower device can recover */
+		dq->best_nsec += dq->best_nsec / 8 + 1;
+	} else if (dq->limit < SCHED_WORKERS) {
+		dq->limit++;
+	}
+}
+
+static DeviceQueue *
+findDevice(DevScheduler *sched, dev_t dev)
+{
+	DeviceQueue *dq = NULL;
+	size_t i = 0;
+
+	for (i = 0; i < sched->ndevices; i++) {
+		if (sched->devices[i].dev == dev) {
+			return &sched->devices[i];
+		}
+	}
+
+	if (sched->ndevices == SCHED_DEVICES) {
+		return NULL;
+	}
+
+	dq = &sched->devices[sched->ndevices++];
+	memset(dq, 0, sizeof(*dq));
+	dq->dev = dev;
+	dq->limit = LIMIT_START;
+
+	return dq;
+}
+
+/* round-robin so that no single device can soak up every worker */
+static DeviceQueue *
+pickDevice(DevScheduler *sched)
+{
+	DeviceQueue *dq = NULL;
+	size_t i = 0;
+
+	for (i = 0; i < sched->ndevices; i++) {
+		dq = &sched->devices[(sched->next_device + i) % sched->ndevices];
+		if (dq->pending.size > 0 && dq->inflight < dq->limit) {
+			sched->next_device = (sched->next_device + i + 1) % 
+			    sched->ndevices;
+			return dq;
+		}
+	}
+
+	return NULL;
+}
+
+static PathNode *
+popPath(DeviceQueue *dq)
+{
+	PathList *list = &dq->pending;
+	PathNode *node = list->head;
+
+	list->head = node->next;
+	if (list->head == NULL) {
+		list->tail = NULL;
+	}
+	list->size--;
+
+	if (dq->batch_end == node) {
+		dq->batch_end = NULL;
+	}
+
+	return node;
+}
+
+static void
+freePath(PathNode *node)
+{
+	free(node->path_name);
+	free(node);
+}
+
+/* the tail is what fts will reach last, so it is the one to give up */
+static void
+dropOldest(DeviceQueue *dq)
+{
+	PathNode *node = dq->pending.head;
+	PathNode *prev = NULL;
+
+	while (node->next != NULL) {
+		prev = node;
+		node = node->next;
+	}
+
+	if (prev == NULL) {
+		dq->pending.head = NULL;
+	} else {
+		prev->next = NULL;
+	}
+	dq->pending.tail = prev;
+	dq->pending.size--;
+
+	if (dq->batch_end == node) {
+		dq->batch_end = prev;
+	}
+
+	freePath(node);
+}
+
+/* 
+ * The first entry of a batch goes on top of the stack and the rest
+ * follow it, so the batch keeps the order fts will visit it in.
+ */
+static void
+pushPath(DevScheduler *sched, DeviceQueue *dq, PathNode *node)
+{
+	PathList *list = &dq->pending;
+
+	if (dq->batch != sched->batch || dq->batch_end == NULL) {
+		node->next = list->head;
+		list->head = node;
+		dq->batch = sched->batch;
+	} else {
+		node->next = dq->batch_end->next;
+		dq->batch_end->next = node;
+	}
+
+	if (node->next == NULL) {
+		list->tail = node;
+	}
+	dq->batch_end = node;
+	list->size++;
+}
+
+static void *
+workerLoop(void *arg)
+{
+	DevScheduler *sched = arg;
+	DeviceQueue *dq = NULL;
+	PathNode *node = NULL;
+	unsigned long nsec = 0;
+
+	(void)pthread_mutex_lock(&sched->lock);
+	for (;;) {
+		while (!sched->shutdown && (dq = pickDevice(sched)) == NULL) {
+			(void)pthread_cond_wait(&sched->work, &sched->lock);
+		}
+
+		/* warming anything once the walk is over is wasted effort */
+		if (sched->shutdown) {
+			break;
+		}
+
+		node = popPath(dq);
+		dq->inflight++;
+		(void)pthread_mutex_unlock(&sched->lock);
+
+		nsec = warmDirectory(sched->base_fd, node->path_name,
+		    sched->warm_flags, NULL);
+		freePath(node);
+
+		(void)pthread_mutex_lock(&sched->lock);
+		dq->inflight--;
+		adjustLimit(dq, nsec);
+		(void)pthread_cond_broadcast(&sched->work);
+	}
+	(void)pthread_mutex_unlock(&sched->lock);
+
+	return NULL;
+}
+
+DevScheduler *
+startScheduler(int warm_flags)
+{
+	DevScheduler *sched = NULL;
+
+	if ((sched = calloc(1, sizeof(*sched))) == NULL) {
+		return NULL;
+	}
+
+	/* fts paths are relative to where the walk started */
+	if ((sched->base_fd = open(".", O_RDONLY | O_DIRECTORY)) == -1) {
+		free(sched);
+		return NULL;
+	}
+
+	sched->warm_flags = warm_flags;
+	(void)pthread_mutex_init(&sched->lock, NULL);
+	(void)pthread_cond_init(&sched->work, NULL);
+
+	for (sched->nworkers = 0; sched->nworkers < SCHED_WORKERS; 
+	    sched->nworkers++) {
+		if (pthread_create(&sched->workers[sched->nworkers], NULL,
+		    workerLoop, sched) != 0) {
+			break;
+		}
+	}
+
+	if (sched->nworkers == 0) {
+		finishScheduler(sched);
+		return NULL;
+	}
+
+	return sched;
+}
+
+/* directories scheduled from here on belong to a new batch */
+void
+beginBatch(DevScheduler *sched)
+{
+	(void)pthread_mutex_lock(&sched->lock);
+	sched->batch++;
+	(void)pthread_mutex_unlock(&sched->lock);
+}
+
+void
+scheduleDirectory(DevScheduler *sched, const char *path, dev_t dev)
+{
+	DeviceQueue *dq = NULL;
+	PathNode *node = NULL;
+
+	(void)pthread_mutex_lock(&sched->lock);
+
+	if ((dq = findDevice(sched, dev)) == NULL) {
+		goto out;
+	}
+
+	if (dq->ewma_nsec != 0 && dq->ewma_nsec < WARM_NSEC &&
+	    ++dq->skipped % PROBE_INTERVAL != 0) {
+		goto out;
+	}
+
+	if ((node = malloc(sizeof(*node))) == NULL) {
+		goto out;
+	}
+
+	if ((node->path_name = strdup(path)) == NULL) {
+		free(node);
+		goto out;
+	}
+
+	node->path_stat = NULL;
+	node->next = NULL;
+	pushPath(sched, dq, node);
+
+	if (dq->pending.size > SCHED_QUEUE_MAX) {
+		dropOldest(dq);
+	}
+
+	(void)pthread_cond_signal(&sched->work);
+
+out:
+	(void)pthread_mutex_unlock(&sched->lock);
+}
+
+void
+finishScheduler(DevScheduler *sched)
+{
+	size_t i = 0;
+
+	if (sched == NULL) {
+		return;
+	}
+
+	(void)pthread_mutex_lock(&sched->lock);
+	sched->shutdown = 1;
+	(void)pthread_cond_broadcast(&sched->work);
+	(void)pthread_mutex_unlock(&sched->lock);
+
+	for (i = 0; i < sched->nworkers; i++) {
+		(void)pthread_join(sched->workers[i], NULL);
+	}
+
+	for (i = 0; i < sched->ndevices; i++) {
+		while (sched->devices[i].pending.size > 0) {
+			freePath(popPath(&sched->devices[i]));
+		}
+	}
+
+	(void)pthread_cond_destroy(&sched->work);
+	(void)pthread_mutex_destroy(&sched->lock);
+	(void)close(sched->base_fd);
+	free(sched);
+}
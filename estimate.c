@@ -0,0 +1,771 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+/*
+ * Approximate tree statistics by random probes (Knuth's estimator).
+ * Each probe walks from the root down one randomly chosen subdirectory
+ * at a time until it reaches a leaf. What it finds in each directory
+ * on the way is scaled by the product of the branching factors above
+ * it, which makes every probe an unbiased estimate of the tree totals;
+ * averaging probes narrows it, and their spread gives a confidence
+ * interval.
+ *
+ * A probe reads only the directories on its path, and stats at most
+ * SAMPLE_FILES files in each, so the cost depends on depth and on the
+ * probe budget rather than on the size of the tree. Of a directory's
+ * names, at most KEEP_NAMES files and as many subdirectories are kept,
+ * a uniform sample of each by reservoir sampling, alongside exact
+ * counts. Directories read once are kept, up to CACHE_BYTES of them,
+ * since every probe passes through the same few near the root. The
+ * time budget is checked within a probe and while reading, and a probe
+ * it cuts short is dropped.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "estimate.h"
+#include "internal.h"
+
+#define SAMPLE_FILES 64		/* files stat'ed per directory at most */
+#define KEEP_NAMES 4096		/* names of each kind kept per directory */
+#define CLOCK_EVERY 1024	/* entries read between deadline checks */
+#define SIZE_CLASSES 65		/* empty, then one per power of two */
+#define Z_95 1.96
+#define CACHE_BYTES (64UL << 20)	/* directories kept between probes */
+#define CACHE_BUCKETS 1024		/* initial, doubled as it fills */
+
+enum Metric {
+	METRIC_FILES,
+	METRIC_DIRS,
+	METRIC_BYTES,
+	METRICS
+};
+
+static const char *metric_names[METRICS] = {
+	"files", "directories", "bytes"
+};
+
+typedef struct Estimate {
+	double sum[METRICS];
+	double sum_sq[METRICS];
+	double classes[SIZE_CLASSES];
+	unsigned long probes;
+	unsigned long dirs_read;
+	Throttle *throttle;	/* --gentle, charged for every read and stat */
+	unsigned long stats;
+	struct timespec deadline;
+} Estimate;
+
+/* one directory's contents, as much of it as a probe needs */
+typedef struct DirScan {
+	char *names;
+	size_t names_len;
+	size_t names_cap;
+	size_t *subdirs;	/* offsets into names, a sample past KEEP_NAMES */
+	size_t nsubdirs;
+	size_t subdirs_cap;
+	size_t *files;
+	size_t nfiles;
+	size_t files_cap;
+	size_t total_subdirs;	/* everything seen, kept or not */
+	size_t total_files;
+	size_t replaced;	/* names no longer referenced from either */
+} DirScan;
+
+/* a directory already read, by device and inode */
+typedef struct CachedDir {
+	struct CachedDir *next;
+	dev_t dev;
+	ino_t ino;
+	DirScan scan;
+} CachedDir;
+
+typedef struct DirCache {
+	CachedDir **buckets;
+	size_t nbuckets;
+	size_t count;
+	size_t bytes;
+} DirCache;
+
+static int
+sizeClass(uint64_t size)
+{
+	int class = 0;
+
+	while (size != 0) {
+		size >>= 1;
+		++class;
+	}
+
+	return class;
+}
+
+static void
+compactOffsets(const DirScan *scan, char *names, size_t *len, 
+		size_t *offs, size_t n)
+{
+	size_t name_len = 0;
+	size_t i = 0;
+
+	for (i = 0; i < n; i++) {
+		name_len = strlen(scan->names + offs[i]) + 1;
+		memcpy(names + *len, scan->names + offs[i], name_len);
+		offs[i] = *len;
+		*len += name_len;
+	}
+}
+
+/* drop names replaced while sampling, so a kept scan stays small */
+static int
+compactNames(DirScan *scan)
+{
+	char *names = NULL;
+	size_t len = 0;
+	size_t need = 0;
+	size_t i = 0;
+
+	if (scan->replaced == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < scan->nsubdirs; i++) {
+		need += strlen(scan->names + scan->subdirs[i]) + 1;
+	}
+	for (i = 0; i < scan->nfiles; i++) {
+		need += strlen(scan->names + scan->files[i]) + 1;
+	}
+
+	if ((names = malloc(need)) == NULL) {
+		return -1;
+	}
+
+	compactOffsets(scan, names, &len, scan->subdirs, scan->nsubdirs);
+	compactOffsets(scan, names, &len, scan->files, scan->nfiles);
+
+	free(scan->names);
+	scan->names = names;
+	scan->names_len = len;
+	scan->names_cap = need;
+	scan->replaced = 0;
+
+	return 0;
+}
+
+static int
+copyName(DirScan *scan, const char *name, size_t *off)
+{
+	size_t len = strlen(name) + 1;
+
+	*off = scan->names_len;
+	if (growBuffer(&scan->names, &scan->names_cap, *off + len, 1) != 0) {
+		return -1;
+	}
+
+	memcpy(scan->names + *off, name, len);
+	scan->names_len += len;
+
+	return 0;
+}
+
+/* 
+ * Count a name and keep it in a uniform sample of at most KEEP_NAMES:
+ * the n-th of its kind replaces a random kept one with chance
+ * KEEP_NAMES / n (Algorithm R).
+ */
+static int
+addName(DirScan *scan, const char *name, int is_dir)
+{
+	size_t **offs = is_dir ? &scan->subdirs : &scan->files;
+	size_t *kept = is_dir ? &scan->nsubdirs : &scan->nfiles;
+	size_t *cap = is_dir ? &scan->subdirs_cap : &scan->files_cap;
+	size_t *total = is_dir ? &scan->total_subdirs : &scan->total_files;
+	size_t slot = 0;
+	size_t off = 0;
+
+	++*total;
+
+	if (*kept < KEEP_NAMES) {
+		if (growBuffer(offs, cap, *kept + 1, sizeof(**offs)) != 0 ||
+		    copyName(scan, name, &off) != 0) {
+			return -1;
+		}
+		(*offs)[(*kept)++] = off;
+		return 0;
+	}
+
+	if ((slot = arc4random_uniform((uint32_t)*total)) >= KEEP_NAMES) {
+		return 0;
+	}
+
+	if (copyName(scan, name, &off) != 0) {
+		return -1;
+	}
+	(*offs)[slot] = off;
+
+	/* replaced names pile up, so drop them now and then */
+	if (++scan->replaced >= 2 * KEEP_NAMES) {
+		return compactNames(scan);
+	}
+
+	return 0;
+}
+
+static int
+pastDeadline(const Estimate *est)
+{
+	struct timespec now;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec > est->deadline.tv_sec ||
+	    (now.tv_sec == est->deadline.tv_sec && 
+	    now.tv_nsec >= est->deadline.tv_nsec);
+}
+
+/* 
+ * Split a directory into subdirectories and everything else. d_type
+ * saves a stat per entry where the filesystem provides it.
+ */
+static int
+scanDirectory(int dir_fd, DirScan *scan, Estimate *est)
+{
+	DIR *dirp = NULL;
+	struct dirent *dent = NULL;
+	struct stat sb;
+	unsigned long nread = 0;
+	int scan_fd = -1;
+	int is_dir = 0;
+	int status = 0;
+
+	scan->names_len = 0;
+	scan->nsubdirs = 0;
+	scan->nfiles = 0;
+	scan->total_subdirs = 0;
+	scan->total_files = 0;
+	scan->replaced = 0;
+
+	/* 
+	 * The stream owns its descriptor, so give it a copy. The copy
+	 * shares the offset an earlier probe left at the end.
+	 */
+	if ((scan_fd = dup(dir_fd)) == -1) {
+		return -1;
+	}
+
+	if ((dirp = fdopendir(scan_fd)) == NULL) {
+		(void)close(scan_fd);
+		return -1;
+	}
+	rewinddir(dirp);
+
+	errno = 0;
+	while (status == 0 && (dent = readdir(dirp)) != NULL) {
+		if (strcmp(dent->d_name, ".") == 0 || 
+		    strcmp(dent->d_name, "..") == 0) {
+			continue;
+		}
+
+		/* a huge directory must not outlast the time budget */
+		if (++nread % CLOCK_EVERY == 0 && pastDeadline(est)) {
+			errno = ETIMEDOUT;
+			status = -1;
+			break;
+		}
+
+		if (dent->d_type != DT_UNKNOWN) {
+			is_dir = dent->d_type == DT_DIR;
+		} else if (fstatat(dir_fd, dent->d_name, &sb, 
+		    AT_SYMLINK_NOFOLLOW) == 0) {
+			++est->stats;
+			throttleStats(est->throttle, 1);
+			is_dir = S_ISDIR(sb.st_mode);
+		} else {
+			continue;
+		}
+
+		status = addName(scan, dent->d_name, is_dir);
+	}
+
+	if (status == 0 && errno != 0) {
+		status = -1;
+	}
+
+	if (status == 0) {
+		status = compactNames(scan);
+	}
+
+	(void)closedir(dirp);
+	++est->dirs_read;
+	throttleDir(est->throttle);
+
+	return status;
+}
+
+static size_t
+bucketOf(const DirCache *cache, dev_t dev, ino_t ino)
+{
+	/* inode numbers are mostly dense, so their low bits spread well */
+	return ((size_t)ino ^ (size_t)dev * 31) & (cache->nbuckets - 1);
+}
+
+static CachedDir *
+findCached(const DirCache *cache, dev_t dev, ino_t ino)
+{
+	CachedDir *node = NULL;
+
+	if (cache->nbuckets == 0) {
+		return NULL;
+	}
+
+	for (node = cache->buckets[bucketOf(cache, dev, ino)]; node != NULL; 
+	    node = node->next) {
+		if (node->dev == dev && node->ino == ino) {
+			return node;
+		}
+	}
+
+	return NULL;
+}
+
+/* double the buckets; on failure the cache just gets slower */
+static void
+growCache(DirCache *cache)
+{
+	CachedDir **old = cache->buckets;
+	CachedDir *node = NULL;
+	CachedDir *next = NULL;
+	size_t old_n = cache->nbuckets;
+	size_t i = 0;
+	size_t b = 0;
+
+	cache->nbuckets = old_n == 0 ? CACHE_BUCKETS : old_n * 2;
+	if ((cache->buckets = calloc(cache->nbuckets, 
+	    sizeof(*cache->buckets))) == NULL) {
+		cache->buckets = old;
+		cache->nbuckets = old_n;
+		return;
+	}
+
+	for (i = 0; i < old_n; i++) {
+		for (node = old[i]; node != NULL; node = next) {
+			next = node->next;
+			b = bucketOf(cache, node->dev, node->ino);
+			node->next = cache->buckets[b];
+			cache->buckets[b] = node;
+		}
+	}
+
+	free(old);
+}
+
+/* 
+ * Keep a scan, taking over its buffers, unless the cache is full. The
+ * scan is left empty if it was kept, or as it was if not.
+ */
+static void
+cacheScan(DirCache *cache, dev_t dev, ino_t ino, DirScan *scan)
+{
+	CachedDir *node = NULL;
+	size_t b = 0;
+	size_t size = sizeof(*node) + scan->names_cap + 
+	    (scan->subdirs_cap + scan->files_cap) * sizeof(size_t);
+
+	if (cache->bytes + size > CACHE_BYTES) {
+		return;
+	}
+
+	if (cache->count >= cache->nbuckets) {
+		growCache(cache);
+		if (cache->nbuckets == 0) {
+			return;
+		}
+	}
+
+	if ((node = malloc(sizeof(*node))) == NULL) {
+		return;
+	}
+
+	node->dev = dev;
+	node->ino = ino;
+	node->scan = *scan;
+	b = bucketOf(cache, dev, ino);
+	node->next = cache->buckets[b];
+	cache->buckets[b] = node;
+	++cache->count;
+	cache->bytes += size;
+
+	memset(scan, 0, sizeof(*scan));
+}
+
+static void
+freeScan(DirScan *scan)
+{
+	free(scan->names);
+	free(scan->subdirs);
+	free(scan->files);
+}
+
+static void
+freeCache(DirCache *cache)
+{
+	CachedDir *node = NULL;
+	CachedDir *next = NULL;
+	size_t i = 0;
+
+	for (i = 0; i < cache->nbuckets; i++) {
+		for (node = cache->buckets[i]; node != NULL; node = next) {
+			next = node->next;
+			freeScan(&node->scan);
+			free(node);
+		}
+	}
+
+	free(cache->buckets);
+}
+
+/* 
+ * The scan of the directory open on dir_fd, from the cache if it was
+ * read before, or read into the scratch scan and cached if it fits.
+ */
+static DirScan *
+lookupScan(int dir_fd, const struct stat *dir_sb, DirCache *cache, 
+		DirScan *scratch, Estimate *est)
+{
+	CachedDir *node = NULL;
+
+	if ((node = findCached(cache, dir_sb->st_dev, dir_sb->st_ino)) != NULL) {
+		return &node->scan;
+	}
+
+	if (scanDirectory(dir_fd, scratch, est) != 0) {
+		return NULL;
+	}
+
+	cacheScan(cache, dir_sb->st_dev, dir_sb->st_ino, scratch);
+	if ((node = findCached(cache, dir_sb->st_dev, dir_sb->st_ino)) != NULL) {
+		return &node->scan;
+	}
+
+	return scratch;
+}
+
+/* 
+ * Count the directory's entries and stat a random sample of its kept
+ * files, scaling the sample up to all of them. The result, times the probe's
+ * weight at this depth, is added to the probe's totals. Returns -1 with
+ * errno ETIMEDOUT if the deadline passes first.
+ */
+static int
+sampleFiles(int dir_fd, DirScan *scan, double weight, double *totals,
+		double *classes, Estimate *est)
+{
+	struct stat sb;
+	double local_classes[SIZE_CLASSES];
+	double local_bytes = 0.0;
+	double scale = 0.0;
+	size_t picked = 0;
+	size_t tmp = 0;
+	size_t i = 0;
+	size_t j = 0;
+	size_t want = scan->nfiles < SAMPLE_FILES ? 
+			scan->nfiles : SAMPLE_FILES;
+
+	totals[METRIC_FILES] += weight * scan->total_files;
+	totals[METRIC_DIRS] += weight * scan->total_subdirs;
+
+	/* partial Fisher-Yates, so the sample has no repeats */
+	for (i = 0; i < want; i++) {
+		j = i + arc4random_uniform((uint32_t)(scan->nfiles - i));
+		tmp = scan->files[i];
+		scan->files[i] = scan->files[j];
+		scan->files[j] = tmp;
+	}
+
+	memset(local_classes, 0, sizeof(local_classes));
+	for (i = 0; i < want; i++) {
+		if (pastDeadline(est)) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (fstatat(dir_fd, scan->names + scan->files[i], &sb, 
+		    AT_SYMLINK_NOFOLLOW) != 0) {
+			continue;
+		}
+		++est->stats;
+		throttleStats(est->throttle, 1);
+		++picked;
+		local_bytes += (double)sb.st_size;
+		local_classes[sizeClass((uint64_t)sb.st_size)] += 1.0;
+	}
+
+	if (picked == 0) {
+		return 0;
+	}
+
+	scale = weight * scan->total_files / picked;
+	totals[METRIC_BYTES] += scale * local_bytes;
+	for (i = 0; i < SIZE_CLASSES; i++) {
+		classes[i] += scale * local_classes[i];
+	}
+
+	return 0;
+}
+
+/* 
+ * One random walk from the root down to a leaf. A walk the deadline
+ * cuts short is dropped, returning -1 with errno ETIMEDOUT.
+ */
+static int
+runProbe(int root_fd, dev_t root_dev, const Options *ls_options, 
+		DirCache *cache, DirScan *scratch, Estimate *est)
+{
+	struct stat sb;
+	DirScan *scan = NULL;
+	double totals[METRICS];
+	double classes[SIZE_CLASSES];
+	double weight = 1.0;
+	const char *next = NULL;
+	int dir_fd = -1;
+	int child_fd = -1;
+	int depth = 0;
+	int i = 0;
+
+	memset(totals, 0, sizeof(totals));
+	memset(classes, 0, sizeof(classes));
+
+	if ((dir_fd = dup(root_fd)) == -1) {
+		return -1;
+	}
+
+	for (;; depth++) {
+		if (pastDeadline(est)) {
+			(void)close(dir_fd);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		/* past the root, a failed read just cuts the walk short */
+		if (fstat(dir_fd, &sb) != 0 || (scan = lookupScan(dir_fd, 
+		    &sb, cache, scratch, est)) == NULL) {
+			if (depth == 0 || errno == ETIMEDOUT) {
+				(void)close(dir_fd);
+				return -1;
+			}
+			break;
+		}
+
+		if (sampleFiles(dir_fd, scan, weight, totals, classes, 
+		    est) != 0) {
+			(void)close(dir_fd);
+			return -1;
+		}
+
+		if (scan->nsubdirs == 0) {
+			break;
+		}
+
+		/* uniform over the kept sample, so over all subdirectories */
+		next = scan->names + scan->subdirs[
+		    arc4random_uniform((uint32_t)scan->nsubdirs)];
+		weight *= scan->total_subdirs;
+
+		/* an unreadable or foreign subdirectory ends the walk early */
+		if ((child_fd = openat(dir_fd, next, 
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1) {
+			break;
+		}
+
+		if (ls_options->one_file_system && 
+		    (fstat(child_fd, &sb) != 0 || sb.st_dev != root_dev)) {
+			(void)close(child_fd);
+			break;
+		}
+
+		(void)close(dir_fd);
+		dir_fd = child_fd;
+	}
+
+	(void)close(dir_fd);
+
+	for (i = 0; i < METRICS; i++) {
+		est->sum[i] += totals[i];
+		est->sum_sq[i] += totals[i] * totals[i];
+	}
+	for (i = 0; i < SIZE_CLASSES; i++) {
+		est->classes[i] += classes[i];
+	}
+	++est->probes;
+
+	return 0;
+}
+
+/* label a size class by its lower bound, as in 0, 1, 512, 4K or 2M */
+static void
+classLabel(char *buf, size_t len, int class)
+{
+	static const char units[] = "BKMGTPE";
+	int shift = class - 1;
+
+	if (class == 0) {
+		(void)snprintf(buf, len, "0");
+	} else if (shift < 10) {
+		(void)snprintf(buf, len, "%lu", 1UL << shift);
+	} else {
+		(void)snprintf(buf, len, "%lu%c", 1UL << (shift % 10), 
+		    units[shift / 10]);
+	}
+}
+
+static void
+reportEstimate(FILE *out, const char *path, const Estimate *est, 
+		double seconds)
+{
+	double n = (double)est->probes;
+	double mean = 0.0;
+	double var = 0.0;
+	double half = 0.0;
+	char label[16];
+	int i = 0;
+
+	fprintf(out, "%s: %lu probes, %lu directories read, %lu stats, "
+	    "%.2fs\n", path, est->probes, est->dirs_read, est->stats,
+	    seconds);
+
+	/* 95% interval from the spread between probes */
+	for (i = 0; i < METRICS; i++) {
+		mean = est->sum[i] / n;
+		var = n > 1 ? (est->sum_sq[i] - n * mean * mean) / (n - 1) : 0;
+		half = var > 0 ? Z_95 * sqrt(var / n) : 0.0;
+		fprintf(out, "%-12s %15.0f +/- %.0f\n", metric_names[i], 
+		    mean, half);
+	}
+
+	fprintf(out, "size distribution (estimated files):\n");
+	for (i = 0; i < SIZE_CLASSES; i++) {
+		if (est->classes[i] / n < 0.5) {
+			continue;
+		}
+		classLabel(label, sizeof(label), i);
+		fprintf(out, "  >= %-6s %15.0f\n", label, est->classes[i] / n);
+	}
+}
+
+static double
+secondsSince(const struct timespec *start)
+{
+	struct timespec now;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (double)(now.tv_sec - start->tv_sec) +
+	    (double)(now.tv_nsec - start->tv_nsec) / NSEC_PER_SEC;
+}
+
+/* 
+ * Report estimated totals for each directory operand. Returns 0, or -1
+ * with errno set if an operand could not be estimated.
+ */
+int
+estimateTree(char **targets, const Options *ls_options, FILE *out,
+		Throttle *throttle)
+{
+	Estimate est;
+	DirCache cache;
+	DirScan scratch;
+	struct stat sb;
+	struct timespec start;
+	long probe = 0;
+	int root_fd = -1;
+	int status = 0;
+	int i = 0;
+
+	memset(&cache, 0, sizeof(cache));
+	memset(&scratch, 0, sizeof(scratch));
+
+	for (i = 0; targets[i] != NULL; i++) {
+		memset(&est, 0, sizeof(est));
+		est.throttle = throttle;
+		(void)clock_gettime(CLOCK_MONOTONIC, &start);
+		est.deadline = start;
+		est.deadline.tv_sec += ls_options->estimate_seconds;
+
+		if ((root_fd = open(targets[i], O_RDONLY | O_DIRECTORY)) == -1 ||
+		    fstat(root_fd, &sb) != 0) {
+			fprintf(stderr, "%s: %s: %s\n", getprogname(), 
+			    targets[i], strerror(errno));
+			if (root_fd != -1) {
+				(void)close(root_fd);
+			}
+			status = -1;
+			continue;
+		}
+
+		for (probe = 0; probe < ls_options->estimate_probes; probe++) {
+			if (runProbe(root_fd, sb.st_dev, ls_options, &cache, 
+			    &scratch, &est) != 0) {
+				break;
+			}
+		}
+		(void)close(root_fd);
+
+		if (i > 0) {
+			fprintf(out, "\n");
+		}
+
+		if (est.probes == 0) {
+			fprintf(stderr, "%s: %s: %s\n", getprogname(), 
+			    targets[i], strerror(errno));
+			status = -1;
+			continue;
+		}
+
+		reportEstimate(out, targets[i], &est, secondsSince(&start));
+	}
+
+	freeScan(&scratch);
+	freeCache(&cache);
+
+	return status;
+}
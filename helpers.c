@@ -35,23 +35,47 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sys/types.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <fts.h>
+#include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "checkpoint.h"
+#include "devsched.h"
+#include "estimate.h"
 #include "helpers.h"
+#include "internal.h"
+#include "pipeline.h"
 #include "print.h"
+#include "snapshot.h"
+#include "throttle.h"
 
-static int scaling = 1;
+#define GENTLE_STATS 2000	/* default --gentle stats per second */
+#define GENTLE_DIRS 100		/* and directory reads per second */
+#define ESTIMATE_PROBES 1000	/* default --estimate budget */
+#define ESTIMATE_SECONDS 30	/* and the most time it may take */
 
-typedef int (*CompPointer)(const FTSENT **, const FTSENT**);
+enum LongOption {
+	OPT_ACROSS = 256,
+	OPT_CHECKPOINT,
+	OPT_CLIENT,
+	OPT_COLOR,
+	OPT_DEDUP_LINKS,
+	OPT_DIFF,
+	OPT_ESTIMATE,
+	OPT_GENTLE,
+	OPT_IDLE,
+	OPT_INODE_ORDER,
+	OPT_RESUME,
+	OPT_SERVER,
+	OPT_SNAPSHOT
+};
 
-void 
-setReverseSort()
-{
-	scaling = -1;
-}
+typedef int (*CompPointer)(const FTSENT **, const FTSENT**);
 
 void 
 setDefaultOptions(Options *opts)
@@ -70,20 +94,317 @@ setDefaultOptions(Options *opts)
 	opts->do_not_sort = 0;
 	opts->show_hidden = 0;
 	opts->show_dir_header = 0;
+	opts->reverse_sort = 0;
 	opts->sort_by_size = 0;
 	opts->sort_time = 0;
 	opts->sort_by_ctime = 0;
 	opts->sort_by_mtime = 0;
 	opts->sort_by_atime = 0;
+	opts->one_file_system = 0;
+	opts->print_columns = 0;
+	opts->columns_across = 0;
+	opts->color_output = COLOR_NEVER;
+	opts->inode_order = 0;
+	opts->readahead_hints = 0;
+	opts->server_socket = NULL;
+	opts->client_socket = NULL;
+	opts->snapshot_file = NULL;
+	opts->diff_file = NULL;
+	opts->gentle_stats = 0;
+	opts->gentle_dirs = 0;
+	opts->idle_priority = 0;
+	opts->estimate_probes = 0;
+	opts->estimate_seconds = 0;
+	opts->checkpoint_file = NULL;
+	opts->resume_checkpoint = 0;
+	opts->dedup_links = 0;
+	opts->keep_cwd = 0;
+
 }
 
-static int 
-nameComp(const FTSENT **first, const FTSENT **second)
+/* "STATS[,DIRS]" per second, with defaults for --gentle on its own */
+static int
+parseRates(const char *arg, Options *opts)
 {
-	return scaling * strcmp((*first)->fts_name, (*second)->fts_name);
+	char *end = NULL;
+
+	opts->gentle_stats = GENTLE_STATS;
+	opts->gentle_dirs = GENTLE_DIRS;
+
+	if (arg == NULL) {
+		return 0;
+	}
+
+	errno = 0;
+	opts->gentle_stats = strtol(arg, &end, 10);
+	if (errno != 0 || end == arg || opts->gentle_stats <= 0) {
+		return -1;
+	}
+
+	if (*end == ',') {
+		arg = end + 1;
+		opts->gentle_dirs = strtol(arg, &end, 10);
+		if (errno != 0 || end == arg || opts->gentle_dirs <= 0) {
+			return -1;
+		}
+	}
+
+	return *end == '\0' ? 0 : -1;
 }
 
+/* "PROBES[,SECONDS]", with defaults for --estimate on its own */
 static int
+parseEstimate(const char *arg, Options *opts)
+{
+	char *end = NULL;
+
+	opts->estimate_probes = ESTIMATE_PROBES;
+	opts->estimate_seconds = ESTIMATE_SECONDS;
+
+	if (arg == NULL) {
+		return 0;
+	}
+
+	errno = 0;
+	opts->estimate_probes = strtol(arg, &end, 10);
+	if (errno != 0 || end == arg || opts->estimate_probes <= 0) {
+		return -1;
+	}
+
+	if (*end == ',') {
+		arg = end + 1;
+		opts->estimate_seconds = strtol(arg, &end, 10);
+		if (errno != 0 || end == arg || opts->estimate_seconds <= 0) {
+			return -1;
+		}
+	}
+
+	return *end == '\0' ? 0 : -1;
+}
+
+int
+parseOptions(int argc, char **argv, Options *opts)
+{
+	int ch;
+	static const struct option long_opts[] = {
+		{"across", no_argument, NULL, OPT_ACROSS},
+		{"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+		{"client", required_argument, NULL, OPT_CLIENT},
+		{"color", optional_argument, NULL, OPT_COLOR},
+		{"dedup-links", no_argument, NULL, OPT_DEDUP_LINKS},
+		{"diff", required_argument, NULL, OPT_DIFF},
+		{"estimate", optional_argument, NULL, OPT_ESTIMATE},
+		{"gentle", optional_argument, NULL, OPT_GENTLE},
+		{"idle", no_argument, NULL, OPT_IDLE},
+		{"inode-order", optional_argument, NULL, OPT_INODE_ORDER},
+		{"resume", no_argument, NULL, OPT_RESUME},
+		{"server", required_argument, NULL, OPT_SERVER},
+		{"snapshot", required_argument, NULL, OPT_SNAPSHOT},
+		{NULL, 0, NULL, 0}
+	};
+
+	/* a server parses a fresh argument vector for every request */
+#ifdef __GLIBC__
+	optind = 0;
+#else
+	optind = 1;
+	optreset = 1;
+#endif
+
+	while ((ch = getopt_long(argc, argv, LS_OPTION_CHARS, long_opts,
+	    NULL)) != -1) {
+		switch (ch) {
+		case '1':
+			opts->print_columns = 0;
+			break;
+		case 'A':
+			opts->show_hidden = 1;
+			break;
+		case 'a':
+			opts->show_self_parent = 1;
+			opts->show_hidden = 1;
+			break;
+		case 'C':
+			opts->print_columns = 1;
+			opts->columns_across = 0;
+			break;
+		case 'c':
+			opts->sort_by_atime = 0;
+			opts->sort_by_mtime = 0;
+			opts->sort_by_ctime = 1;
+			break;
+		case 'd':
+			opts->plain_dirs = 1;
+			/* is this hackish? */
+			opts->show_dir_header = 1;
+			break;
+		case 'F':
+			opts->print_file_type = 1;
+			break;
+		case 'f':
+			/* as in NetBSD, we take -f to imply -a */
+			opts->show_hidden = 1;
+			opts->do_not_sort = 1;
+			break;
+		case 'G':
+			opts->color_output = COLOR_AUTO;
+			break;
+		case 'h':
+			opts->report_in_kb = 0;
+			opts->human_readable = 1;
+			break;
+		case 'i':
+			opts->print_inode = 1;
+			break;
+		case 'k':
+			opts->human_readable = 0;
+			opts->report_in_kb = 1;
+			break;
+		case 'l':
+			opts->print_long_format = 1;
+			opts->print_numeric_uid_gid = 0;
+			break;
+		case 'n':
+			opts->print_long_format = 1;
+			opts->print_numeric_uid_gid = 1;
+			break;
+		case 'q':
+			opts->mark_nonprinting = 1;
+			break;
+		case 'R':
+			opts->list_dir_recursive = 1;
+			break;
+		case 'r':
+			opts->reverse_sort = 1;
+			break;
+		case 'S':
+			opts->sort_by_size = 1;
+			break;
+		case 's':
+			opts->print_bsize = 1;
+			break;
+		case 't':
+			opts->sort_time = 1;
+			opts->sort_by_atime = 0;
+			opts->sort_by_mtime = 1;
+			opts->sort_by_ctime = 0;
+			break;
+		case 'u':
+			opts->sort_by_atime = 1;
+			opts->sort_by_mtime = 0;
+			opts->sort_by_ctime = 0;
+			break;
+		case 'w':
+			opts->mark_nonprinting = 0;
+			break;
+		case 'x':
+			opts->one_file_system = 1;
+			break;
+		case OPT_ACROSS:
+			/* -x already means one file system here */
+			opts->print_columns = 1;
+			opts->columns_across = 1;
+			break;
+		case OPT_COLOR:
+			if (optarg == NULL || strcmp(optarg, "always") == 0) {
+				opts->color_output = COLOR_ALWAYS;
+			} else if (strcmp(optarg, "auto") == 0) {
+				opts->color_output = COLOR_AUTO;
+			} else if (strcmp(optarg, "never") == 0) {
+				opts->color_output = COLOR_NEVER;
+			} else {
+				return -1;
+			}
+			break;
+		case OPT_SERVER:
+			opts->server_socket = optarg;
+			break;
+		case OPT_CLIENT:
+			opts->client_socket = optarg;
+			break;
+		case OPT_SNAPSHOT:
+			opts->snapshot_file = optarg;
+			break;
+		case OPT_DEDUP_LINKS:
+			opts->dedup_links = 1;
+			break;
+		case OPT_DIFF:
+			opts->diff_file = optarg;
+			break;
+		case OPT_CHECKPOINT:
+			opts->checkpoint_file = optarg;
+			break;
+		case OPT_RESUME:
+			opts->resume_checkpoint = 1;
+			break;
+		case OPT_ESTIMATE:
+			if (parseEstimate(optarg, opts) != 0) {
+				return -1;
+			}
+			break;
+		case OPT_GENTLE:
+			if (parseRates(optarg, opts) != 0) {
+				return -1;
+			}
+			break;
+		case OPT_IDLE:
+			opts->idle_priority = 1;
+			break;
+		case OPT_INODE_ORDER:
+			opts->inode_order = 1;
+			if (optarg != NULL && strcmp(optarg, "readahead") == 0) {
+				opts->readahead_hints = 1;
+			} else if (optarg != NULL) {
+				return -1;
+			}
+			break;
+		case '?':
+		default:
+			return -1;
+		}
+	}
+
+	/* these each replace the listing, so only one makes sense */
+	if ((opts->snapshot_file != NULL) + (opts->diff_file != NULL) +
+	    (opts->estimate_probes > 0) > 1) {
+		return -1;
+	}
+
+	/* checkpoints follow the recursive walk and nothing else */
+	if ((opts->checkpoint_file != NULL && !opts->list_dir_recursive) ||
+	    (opts->resume_checkpoint && opts->checkpoint_file == NULL)) {
+		return -1;
+	}
+
+	/* a resumed listing never sees what it skips, so cannot total it */
+	if (opts->dedup_links && opts->resume_checkpoint) {
+		return -1;
+	}
+
+	return optind;
+}
+
+void
+normalizeDirNames(const int argc, char **argv)
+{
+	int i = 0;
+	size_t len = 0;
+
+	for (i = 0; i < argc; i++) {
+		len = strlen(argv[i]);
+		if (len > 1 && (argv[i][len-1] == '/')) {
+			argv[i][len-1] = '\0';
+		}
+	}
+}
+
+int
+nameComp(const FTSENT **first, const FTSENT **second)
+{
+	return strcmp((*first)->fts_name, (*second)->fts_name);
+}
+
+int
 sizeComp(const FTSENT **first, const FTSENT **second)
 {
 	const off_t s1 = (*first)->fts_statp->st_size;
@@ -91,9 +412,9 @@ sizeComp(const FTSENT **first, const FTSENT **second)
 
 	/* we want largest file to sort first, so we reverse a < b logic */
 	if (s1 < s2) {
-		return 1 * scaling;
+		return 1;
 	} else if (s1 > s2) {
-		return -1 * scaling;
+		return -1;
 	}
 
 	/* sizes equal, sort lexicographically */
@@ -108,16 +429,16 @@ ctimeComp(const FTSENT **first, const FTSENT **second)
 
 	/* we want most recent to sort first, so we reverse a < b logic */
 	if (t1 < t2) {
-		return 1 * scaling;
+		return 1;
 	} else if (t1 > t2) {
-		return -1 * scaling;
+		return -1;
 	}
 
 	/* times equal, so sort lexicographically */
 	return nameComp(first, second);
 }
 
-static int
+int
 mtimeComp(const FTSENT **first, const FTSENT **second)
 {
 	const time_t t1 = (*first)->fts_statp->st_mtime;
@@ -125,9 +446,9 @@ mtimeComp(const FTSENT **first, const FTSENT **second)
 
 	/* we want most recent to sort first, so we reverse a < b logic */
 	if (t1 < t2) {
-		return 1 * scaling;
+		return 1;
 	} else if (t1 > t2) {
-		return -1 * scaling;
+		return -1;
 	}
 
 	/* times equal, so sort lexicographically */
@@ -142,37 +463,250 @@ atimeComp(const FTSENT **first, const FTSENT **second)
 
 	/* we want most recent to sort first, so we reverse a < b logic */
 	if (t1 < t2) {
-		return 1 * scaling;
+		return 1;
 	} else if (t1 > t2) {
-		return -1 * scaling;
+		return -1;
 	}
 
 	/* times equal, so sort lexicographically */
 	return nameComp(first, second);
 }
 
+/* 
+ * fts passes a comparator nothing but the entries, so -r picks a
+ * reversed twin rather than consulting shared state.
+ */
+static int
+revNameComp(const FTSENT **first, const FTSENT **second)
+{
+	return nameComp(second, first);
+}
+
+static int
+revSizeComp(const FTSENT **first, const FTSENT **second)
+{
+	return sizeComp(second, first);
+}
+
+static int
+revCtimeComp(const FTSENT **first, const FTSENT **second)
+{
+	return ctimeComp(second, first);
+}
+
+static int
+revMtimeComp(const FTSENT **first, const FTSENT **second)
+{
+	return mtimeComp(second, first);
+}
+
+static int
+revAtimeComp(const FTSENT **first, const FTSENT **second)
+{
+	return atimeComp(second, first);
+}
+
 CompPointer
 chooseSort(const Options *ls_options)
 {
-	CompPointer cptr = nameComp;
+	const int rev = ls_options->reverse_sort;
+	CompPointer cptr = rev ? revNameComp : nameComp;
 
 	if (ls_options->do_not_sort) {
 		cptr = NULL;
 	} else if (ls_options->sort_by_size) {
-		cptr = sizeComp;
+		cptr = rev ? revSizeComp : sizeComp;
 	} else if (ls_options->sort_time) {
-		cptr = mtimeComp;	
+		cptr = rev ? revMtimeComp : mtimeComp;	
 
 		if (ls_options->sort_by_atime) {
-			cptr = atimeComp;
+			cptr = rev ? revAtimeComp : atimeComp;
 		} else if (ls_options->sort_by_ctime) {
-			cptr = ctimeComp;
+			cptr = rev ? revCtimeComp : ctimeComp;
 		}
 	}
 	
 	return cptr;
 }
 
+long
+getUserBlockSize(const Options *ls_options)
+{
+	long user_bsize = 512;
+
+	if (ls_options->report_in_kb) {
+		user_bsize = 1024;
+	} else {
+		(void)getbsize(NULL, &user_bsize);
+	}
+
+	return user_bsize;
+}
+
+static int
+emitError(EntrySink *sink, const char *name, int error)
+{
+	LsEntry ent;
+
+	ent.kind = ENTRY_ERROR;
+	ent.name = name;
+	ent.accpath = name;
+	ent.link_target = NULL;
+	ent.statp = NULL;
+	ent.info = FTS_ERR;
+	ent.level = 0;
+	ent.error = error;
+
+	return sink->emit(sink, &ent);
+}
+
+static int
+emitHeader(EntrySink *sink, const FTSENT *fts_dir)
+{
+	LsEntry ent;
+
+	ent.kind = ENTRY_HEADER;
+	ent.name = fts_dir->fts_name;
+	ent.accpath = fts_dir->fts_accpath;
+	ent.link_target = NULL;
+	ent.statp = fts_dir->fts_statp;
+	ent.info = fts_dir->fts_info;
+	ent.level = fts_dir->fts_level;
+	ent.error = 0;
+
+	return sink->emit(sink, &ent);
+}
+
+static int
+emitEntry(EntrySink *sink, const FTSENT *fts_ent, const Options *ls_options)
+{
+	char symlink_path[PATH_MAX];
+	struct stat target;
+	ssize_t plen = 0;
+	int stop = 0;
+	LsEntry ent;
+
+	ent.kind = ENTRY_FILE;
+	ent.name = fts_ent->fts_name;
+	ent.accpath = fts_ent->fts_accpath;
+	ent.link_target = NULL;
+	ent.statp = fts_ent->fts_statp;
+	ent.info = fts_ent->fts_info;
+	ent.level = fts_ent->fts_level;
+	ent.error = 0;
+
+	/* 
+	 * fts may chdir() away before a sink gets around to printing,
+	 * so link targets have to be resolved while accpath is valid.
+	 * A failure goes through the sink to stay in order with output.
+	 */
+	if (ls_options->print_long_format && 
+	    S_ISLNK(fts_ent->fts_statp->st_mode)) {
+		if ((plen = readlink(fts_ent->fts_accpath, symlink_path,
+		    PATH_MAX - 1)) == -1) {
+			if ((stop = emitError(sink, fts_ent->fts_name, 
+			    errno)) != 0) {
+				return stop;
+			}
+		} else {
+			symlink_path[plen] = '\0';
+			ent.link_target = symlink_path;
+		}
+	}
+
+	/* FTS_PHYSICAL never reports FTS_SLNONE, so look for orphans here */
+	if (ls_options->color_output == COLOR_ALWAYS &&
+	    S_ISLNK(fts_ent->fts_statp->st_mode) &&
+	    stat(fts_ent->fts_accpath, &target) != 0) {
+		ent.info = FTS_SLNONE;
+	}
+
+	return sink->emit(sink, &ent);
+}
+
+static int
+warmFlags(const Options *ls_options)
+{
+	int flags = 0;
+
+	if (ls_options->inode_order) {
+		flags |= WARM_INODE_ORDER;
+	}
+
+	if (ls_options->readahead_hints) {
+		flags |= WARM_READAHEAD;
+	}
+
+	return flags;
+}
+
+/* 
+ * Stat a directory's entries in inode order just before fts reads it.
+ * fts then finds everything in cache and sorts with chooseSort() as
+ * usual, so only the order of disk accesses changes.
+ */
+static void
+prestatByInode(const FTSENT *fts_dir, const Options *ls_options,
+		Throttle *throttle)
+{
+	unsigned long nstats = 0;
+	int saved_errno = errno;
+
+	(void)warmDirectory(AT_FDCWD, fts_dir->fts_accpath, 
+	    warmFlags(ls_options), &nstats);
+
+	/* these stats count against --gentle like any others */
+	throttleStats(throttle, nstats);
+
+	errno = saved_errno;
+}
+
+/* 
+ * With -x, a directory on another device is a mount point that fts
+ * lists but will not enter, so nothing below it may be read.
+ */
+static int
+foreignDirectory(const FTSENT *fts_dir, const Options *ls_options, 
+		dev_t root_dev)
+{
+	return ls_options->one_file_system && 
+	    fts_dir->fts_statp->st_dev != root_dev;
+}
+
+/* queue a directory's subdirectories, in fts order, for read-ahead */
+static void
+prefetchChildren(DevScheduler *sched, FTS *fts_hier, const FTSENT *fts_dir,
+		const Options *ls_options, dev_t root_dev)
+{
+	FTSENT *child = NULL;
+	char path[PATH_MAX];
+	int saved_errno = errno;
+
+	beginBatch(sched);
+
+	/* fts_read() reuses this list, so it costs no extra stat calls */
+	for (child = fts_children(fts_hier, 0); child != NULL; 
+	    child = child->fts_link) {
+		if (child->fts_info != FTS_D) {
+			continue;
+		}
+
+		if (foreignDirectory(child, ls_options, root_dev)) {
+			continue;
+		}
+
+		if ((size_t)snprintf(path, sizeof(path), "%s/%s", 
+		    fts_dir->fts_path, child->fts_name) >= sizeof(path)) {
+			continue;
+		}
+
+		scheduleDirectory(sched, path, child->fts_statp->st_dev);
+	}
+
+	/* a failure here resurfaces as fts_errno once fts reads the dir */
+	errno = saved_errno;
+}
+
 static int
 showEntry(FTSENT *fts_ent, const Options *ls_options)
 {
@@ -201,8 +735,74 @@ showEntry(FTSENT *fts_ent, const Options *ls_options)
 	return 1;
 }
 
-void
-traverseShallow(char **inputs, const Options *ls_options)
+/* 
+ * While resuming, everything before the checkpoint's cursor has been
+ * listed already. Directories on the way down to it are entered, any
+ * other directory is passed over unread. Returns 1 to pass over ent,
+ * or 0 once ent is the cursor and listing should carry on from it.
+ */
+static int
+replayEntry(FTS *fts_hier, FTSENT *fts_ent, const Checkpoint *checkpoint)
+{
+	size_t level = (size_t)fts_ent->fts_level;
+
+	if (fts_ent->fts_info == FTS_DP) {
+		return 1;
+	}
+
+	if (level < checkpoint->depth && 
+	    strcmp(fts_ent->fts_name, checkpoint->components[level]) == 0) {
+		return level + 1 == checkpoint->depth ? 0 : 1;
+	}
+
+	if (fts_ent->fts_info == FTS_D) {
+		(void)fts_set(fts_hier, fts_ent, FTS_SKIP);
+	}
+
+	return 1;
+}
+
+/* 
+ * Whether a save before this entry falls between groups the sink
+ * aligns together: nothing is held back, or the header, error or
+ * change of level this entry brings ends the group anyway.
+ */
+static int
+groupBoundary(EntrySink *sink, FTSENT *fts_ent, const Options *ls_options,
+		short curr_level, short last_level)
+{
+	if (sink->pending == NULL || sink->pending(sink) == 0) {
+		return 1;
+	}
+
+	return fts_ent->fts_errno != 0 || fts_ent->fts_level > curr_level ||
+	    (showEntry(fts_ent, ls_options) && 
+	    fts_ent->fts_level != last_level);
+}
+
+/* returns 0, or -1 with errno set if the checkpoint was not saved */
+static int
+saveProgress(EntrySink *sink, Checkpoint *checkpoint, 
+		const FTSENT *cursor, short curr_level)
+{
+	off_t offset = 0;
+
+	if (sink->sync(sink, &offset) != 0) {
+		return -1;
+	}
+
+	return saveCheckpoint(checkpoint, cursor, curr_level, offset);
+}
+
+/* 
+ * Both traversals return 0 once the hierarchy is exhausted, -1 with
+ * errno set if fts itself fails, or whatever non-zero value a sink
+ * returned to cut the walk short. The caller sets up the throttle and
+ * reports on it afterwards, if it wants to.
+ */
+int
+traverseShallow(char **inputs, const Options *ls_options, EntrySink *sink,
+		Throttle *throttle)
 {
 	FTS *fts_hier = NULL;
 	FTSENT *fts_ent = NULL;
@@ -210,102 +810,383 @@ traverseShallow(char **inputs, const Options *ls_options)
 
 	int fts_options = FTS_PHYSICAL;
 	int fts_term = 0;
-
-	long user_bsize = 512;
+	int stop = 0;
+	int saved_errno = 0;
 
 	if (ls_options->show_self_parent) {
 		fts_options |= FTS_SEEDOT;
 	}
 
+	if (ls_options->one_file_system) {
+		fts_options |= FTS_XDEV;
+	}
+
+	/* the cwd is the whole process's, and other threads may need it */
+	if (ls_options->keep_cwd) {
+		fts_options |= FTS_NOCHDIR;
+	}
+
 	fcomp = chooseSort(ls_options);	
 
-	if (ls_options->report_in_kb) {
-		user_bsize = 1024;
-	} else {
-		(void)getbsize(NULL, &user_bsize);
+	if ((fts_hier = fts_open(inputs, fts_options, fcomp)) == NULL) {
+		return -1;
 	}
-	
-	fts_hier = fts_open(inputs, fts_options, fcomp);
-	while ((fts_ent = fts_read(fts_hier)) != NULL) {
+
+	while (stop == 0 && (fts_ent = fts_read(fts_hier)) != NULL) {
+		if (fts_ent->fts_info != FTS_DP) {
+			throttleStats(throttle, 1);
+		}
+
 		if (fts_ent->fts_errno != 0) {
-			printf("%s: %s: %s\n", getprogname(),
-				fts_ent->fts_accpath, 
-				strerror(fts_ent->fts_errno));	
+			stop = emitError(sink, fts_ent->fts_accpath,
+				fts_ent->fts_errno);
 			continue;
 		}
 
 		if (showEntry(fts_ent, ls_options)) {
-			printEntry(fts_ent, user_bsize, ls_options);
+			stop = emitEntry(sink, fts_ent, ls_options);
 		}
 
 		fts_term = (fts_ent->fts_level != 0) || 
 			   (ls_options->plain_dirs); 
 
+		/* pay for the directory read before fts goes in */
+		if (fts_ent->fts_info == FTS_D && !fts_term) {
+			throttleDir(throttle);
+		}
+
+		if (fts_ent->fts_info == FTS_D && !fts_term &&
+		    ls_options->inode_order) {
+			prestatByInode(fts_ent, ls_options, throttle);
+		}
+
 		if (fts_ent->fts_info == FTS_D && fts_term) {
 			if (fts_set(fts_hier, fts_ent, FTS_SKIP) != 0) {
-				perror("fts_set() entry");
-				exit(EXIT_FAILURE);
+				saved_errno = errno;
+				(void)fts_close(fts_hier);
+				errno = saved_errno;
+				return -1;
 			}
 		}
 	}
 
-	if (errno != 0) {
-		perror("FTS traversal");
-		exit(EXIT_FAILURE);
+	if (stop == 0 && errno != 0) {
+		saved_errno = errno;
+		(void)fts_close(fts_hier);
+		errno = saved_errno;
+		return -1;
 	}
 
 	(void)fts_close(fts_hier);
+
+	return stop;
 }
 
-void
-traverseRecursive(char **inputs, const Options *ls_options)
+int
+traverseRecursive(char **inputs, const Options *ls_options, EntrySink *sink,
+		Throttle *throttle)
 {
 	FTS *fts_hier = NULL;
 	FTSENT *fts_ent = NULL;
 	CompPointer fcomp = NULL;
 
+	DevScheduler *sched = NULL;
+	Checkpoint checkpoint;
+	dev_t root_dev = 0;
+
 	short curr_level = 1;
+	short last_level = -1;	/* of the last entry listed */
 	int fts_options = FTS_PHYSICAL;
-	long user_bsize = 512;
+	int checkpointing = 0;
+	int resuming = 0;
+	int stop = 0;
+	int saved_errno = 0;
+
+	/* checkpoints need a sink that can say what has been written */
+	if (ls_options->checkpoint_file != NULL && sink->sync != NULL) {
+		if (initCheckpoint(&checkpoint, 
+		    ls_options->checkpoint_file) != 0) {
+			return -1;
+		}
+
+		if (ls_options->resume_checkpoint) {
+			if (loadCheckpoint(&checkpoint) != 0) {
+				saved_errno = errno;
+				freeCheckpoint(&checkpoint);
+				errno = saved_errno;
+				return -1;
+			}
+			curr_level = checkpoint.curr_level;
+			resuming = 1;
+		}
+		checkpointing = 1;
+	}
 
 	if (ls_options->show_self_parent) {
 		fts_options |= FTS_SEEDOT;
 	}
 
+	if (ls_options->one_file_system) {
+		fts_options |= FTS_XDEV;
+	}
+
+	/* the cwd is the whole process's, and other threads may need it */
+	if (ls_options->keep_cwd) {
+		fts_options |= FTS_NOCHDIR;
+	}
+
 	fcomp = chooseSort(ls_options);	
 
-	if (ls_options->report_in_kb) {
-		user_bsize = 1024;
-	} else {
-		(void)getbsize(NULL, &user_bsize);
+	if ((fts_hier = fts_open(inputs, fts_options, fcomp)) == NULL) {
+		if (checkpointing) {
+			saved_errno = errno;
+			freeCheckpoint(&checkpoint);
+			errno = saved_errno;
+		}
+		return -1;
 	}
-	
-	fts_hier = fts_open(inputs, fts_options, fcomp);
-	while ((fts_ent = fts_read(fts_hier)) != NULL) {
+
+	/* 
+	 * Read-ahead is only an optimization, so carry on without it. A
+	 * gentle walk goes without, as it would stat ahead of the limits.
+	 */
+	if (!throttle->enabled) {
+		sched = startScheduler(warmFlags(ls_options));
+	}
+
+	while (stop == 0 && (fts_ent = fts_read(fts_hier)) != NULL) {
+		/* -x keeps to the device of the operand being walked */
+		if (fts_ent->fts_info == FTS_D && 
+		    fts_ent->fts_level == FTS_ROOTLEVEL) {
+			root_dev = fts_ent->fts_statp->st_dev;
+		}
+
+		if (resuming && 
+		    (resuming = replayEntry(fts_hier, fts_ent, &checkpoint))) {
+			continue;
+		}
+
+		/* 
+		 * Save only where syncing flushes no group early, so the
+		 * output is the same with or without checkpoints. The
+		 * printer ends groups every few thousand entries, which
+		 * lets a flat directory be saved midway too.
+		 */
+		if (checkpointing && fts_ent->fts_info != FTS_DP &&
+		    checkpointDue(&checkpoint) && groupBoundary(sink, 
+		    fts_ent, ls_options, curr_level, last_level)) {
+			stop = saveProgress(sink, &checkpoint, fts_ent, 
+			    curr_level);
+			if (stop != 0) {
+				break;
+			}
+		}
+
+		if (fts_ent->fts_info != FTS_DP) {
+			throttleStats(throttle, 1);
+		}
+
+		if (fts_ent->fts_info == FTS_D) {
+			throttleDir(throttle);
+		}
+
 		if (fts_ent->fts_errno != 0) {
-			printf("%s: %s: %s\n", getprogname(),
-				fts_ent->fts_name, 
-				strerror(fts_ent->fts_errno));	
+			stop = emitError(sink, fts_ent->fts_name,
+				fts_ent->fts_errno);
 			continue;
 		}
 
+		if (fts_ent->fts_info == FTS_D && ls_options->inode_order &&
+		    !foreignDirectory(fts_ent, ls_options, root_dev)) {
+			prestatByInode(fts_ent, ls_options, throttle);
+		}
+
+		if (sched != NULL && fts_ent->fts_info == FTS_D &&
+		    !foreignDirectory(fts_ent, ls_options, root_dev)) {
+			prefetchChildren(sched, fts_hier, fts_ent, ls_options,
+			    root_dev);
+		}
+
 		if (fts_ent->fts_level > curr_level) {
-			printf("\n");
-			printf("%s:\n", fts_ent->fts_parent->fts_name);
+			stop = emitHeader(sink, fts_ent->fts_parent);
 			curr_level = fts_ent->fts_level;
 		}
 
-		if (showEntry(fts_ent, ls_options)) {
-			printEntry(fts_ent, user_bsize, ls_options);
+		if (stop == 0 && showEntry(fts_ent, ls_options)) {
+			stop = emitEntry(sink, fts_ent, ls_options);
+			last_level = fts_ent->fts_level;
 		}
 	}
 
-	if (errno != 0) {
-		perror("FTS traversal");
-		exit(EXIT_FAILURE);
+	/* a cursor that never came up means the tree has changed */
+	if (stop == 0 && errno == 0 && resuming) {
+		errno = ENOENT;
 	}
 
+	if (stop == 0 && errno != 0) {
+		saved_errno = errno;
+		finishScheduler(sched);
+		(void)fts_close(fts_hier);
+		if (checkpointing) {
+			freeCheckpoint(&checkpoint);
+		}
+		errno = saved_errno;
+		return -1;
+	}
+
+	finishScheduler(sched);
 	(void)fts_close(fts_hier);
 
-	return;
+	if (checkpointing) {
+		if (stop == 0 && removeCheckpoint(&checkpoint) != 0) {
+			stop = -1;
+		}
+		saved_errno = errno;
+		freeCheckpoint(&checkpoint);
+		errno = saved_errno;
+	}
+
+	return stop;
+}
+
+int
+listDirectory(char **inputs, const Options *ls_options, FILE *out,
+		Throttle *throttle)
+{
+	Pipeline *pipeline = NULL;
+	PrintSink direct;
+	EntrySink *sink = NULL;
+	int status = 0;
+	int write_status = 0;
+	int saved_errno = 0;
+
+	/* snapshots always cover the whole tree and print no listing */
+	if (ls_options->snapshot_file != NULL) {
+		if ((status = writeSnapshot(inputs, ls_options, 
+		    ls_options->snapshot_file, throttle)) != 0) {
+			perror(ls_options->snapshot_file);
+		}
+		return status;
+	} else if (ls_options->diff_file != NULL) {
+		if ((status = diffSnapshot(inputs, ls_options, 
+		    ls_options->diff_file, out, throttle)) != 0) {
+			perror(ls_options->diff_file);
+		}
+		if (fflush(out) != 0) {
+			perror("write output");
+			status = -1;
+		}
+		return status;
+	} else if (ls_options->estimate_probes > 0) {
+		status = estimateTree(inputs, ls_options, out, throttle);
+		if (fflush(out) != 0) {
+			perror("write output");
+			status = -1;
+		}
+		return status;
+	}
+
+	if (ls_options->checkpoint_file != NULL &&
+	    prepareOutput(ls_options->checkpoint_file, 
+	    ls_options->resume_checkpoint, out) != 0) {
+		perror(ls_options->checkpoint_file);
+		return -1;
+	}
+
+	/* 
+	 * Threads only pay for themselves on a recursive walk, and a
+	 * checkpoint has to know exactly what reached the output.
+	 */
+	if (ls_options->list_dir_recursive && 
+	    ls_options->checkpoint_file == NULL && 
+	    (pipeline = startPipeline(out, ls_options)) != NULL) {
+		sink = pipelineSink(pipeline);
+	} else {
+		/* no threads to spare, so format and write inline */
+		initPrintSink(&direct, out, ls_options);
+		sink = &direct.sink;
+	}
+
+	if (ls_options->list_dir_recursive) {
+		status = traverseRecursive(inputs, ls_options, sink, throttle);
+	} else {
+		status = traverseShallow(inputs, ls_options, sink, throttle);
+	}
+
+	saved_errno = errno;
+
+	/* 
+	 * Drain whatever was listed before reporting any failure. Sinks
+	 * stop the walk once output fails, so that is the error to report.
+	 */
+	if (pipeline != NULL) {
+		write_status = finishPipeline(pipeline);
+	} else {
+		finishPrintSink(&direct);
+		if (fflush(out) != 0) {
+			write_status = -1;
+		} else if (ferror(out)) {
+			errno = EIO;
+			write_status = -1;
+		}
+	}
+
+	if (write_status != 0) {
+		perror("write output");
+		return -1;
+	}
+
+	if (status != 0) {
+		errno = saved_errno;
+		perror("FTS traversal");
+	}
+
+	return status;
+}
+
+/* grow *bufp, of *cap items, to hold at least need of them */
+int
+growBuffer(void *bufp, size_t *cap, size_t need, size_t item_size)
+{
+	void **buf = bufp;
+	void *grown = NULL;
+	size_t new_cap = *cap == 0 ? 64 : *cap;
+
+	if (need <= *cap) {
+		return 0;
+	}
+
+	while (new_cap < need) {
+		new_cap *= 2;
+	}
+
+	if ((grown = realloc(*buf, new_cap * item_size)) == NULL) {
+		return -1;
+	}
+
+	*buf = grown;
+	*cap = new_cap;
+
+	return 0;
+}
+
+/* write all of buf, retrying short writes and EINTR */
+int
+writeFully(int fd, const void *buf, size_t len)
+{
+	const char *pos = buf;
+	ssize_t put = 0;
+
+	while (len > 0) {
+		if ((put = write(fd, pos, len)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		pos += put;
+		len -= (size_t)put;
+	}
+
+	return 0;
 }
@@ -34,8 +34,24 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef LS_HELPERS_H
 #define LS_HELPERS_H
 
+#include <sys/types.h>
 #include <sys/stat.h>
 
+#include <stdio.h>
+
+#include "throttle.h"
+
+#define LS_OPTION_CHARS "1AaCcdFfGhiklnqRrSstuwx"
+
+/* libls is built with hidden visibility and exports only these */
+#define LS_PUBLIC __attribute__((__visibility__("default")))
+
+enum ColorWhen {
+	COLOR_NEVER,
+	COLOR_AUTO,	/* resolved against the output stream by the caller */
+	COLOR_ALWAYS
+};
+
 typedef struct Options {
 	int show_self_parent;
 	int list_dir_recursive;
@@ -50,12 +66,32 @@ typedef struct Options {
 	int report_in_kb;
 	int show_hidden;
 	int show_dir_header;
+	int reverse_sort;
 	int sort_by_size;
 	int sort_time;
 	int sort_by_ctime;
 	int sort_by_mtime;
 	int sort_by_atime;
 	int do_not_sort;
+	int one_file_system;
+	int print_columns;
+	int columns_across;
+	int color_output;
+	int inode_order;
+	int readahead_hints;
+	const char *server_socket;
+	const char *client_socket;
+	const char *snapshot_file;
+	const char *diff_file;
+	long gentle_stats;	/* per second, 0 for no limit */
+	long gentle_dirs;
+	int idle_priority;
+	long estimate_probes;	/* 0 unless estimating */
+	long estimate_seconds;	/* time budget for the probes */
+	const char *checkpoint_file;
+	int resume_checkpoint;
+	int dedup_links;	/* print a total counting each inode once */
+	int keep_cwd;		/* walk without chdir, as lsIterate() does */
 } Options;
 
 typedef struct PathNode {
@@ -66,12 +102,52 @@ typedef struct PathNode {
 
 typedef struct PathList {
 	struct PathNode *head;
+	struct PathNode *tail;
 	size_t size;
 } PathList;
 
-void setReverseSort();
-void setDefaultOptions(Options *);
-void traverseShallow(char **, const Options *);
-void traverseRecursive(char **, const Options *);
+enum EntryKind {
+	ENTRY_FILE,
+	ENTRY_HEADER,
+	ENTRY_ERROR
+};
+
+/* 
+ * A single traversal result handed to an EntrySink. The pointers
+ * refer to traversal-owned memory and are only valid for the
+ * duration of the emit() call.
+ */
+typedef struct LsEntry {
+	int kind;
+	const char *name;
+	const char *accpath;
+	const char *link_target;
+	const struct stat *statp;
+	int info;
+	short level;
+	int error;
+} LsEntry;
+
+/* 
+ * emit() returns 0 to continue or non-zero to stop the traversal.
+ * sync(), if the sink has one, pushes everything emitted so far to
+ * stable storage and reports the output offset it reached. pending(),
+ * if any, counts the entries held back to be aligned together, which
+ * a sync would write out early.
+ */
+typedef struct EntrySink {
+	int (*emit)(struct EntrySink *, const LsEntry *);
+	int (*sync)(struct EntrySink *, off_t *);
+	size_t (*pending)(struct EntrySink *);
+	void *state;
+} EntrySink;
+
+LS_PUBLIC void setDefaultOptions(Options *);
+int parseOptions(int, char **, Options *);
+void normalizeDirNames(const int, char **);
+int listDirectory(char **, const Options *, FILE *, Throttle *);
+LS_PUBLIC long getUserBlockSize(const Options *);
+int traverseShallow(char **, const Options *, EntrySink *, Throttle *);
+int traverseRecursive(char **, const Options *, EntrySink *, Throttle *);
 
 #endif /* LS_HELPERS_H */
@@ -0,0 +1,78 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef LS_INTERNAL_H
+#define LS_INTERNAL_H
+
+#include <sys/stat.h>
+
+#include <fts.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "helpers.h"
+
+/* 
+ * Per-entry kernels shared by helpers.c, print.c and bench/micro.c,
+ * and small utilities for the other modules. They are not part of
+ * libls, whose build keeps them hidden.
+ */
+
+#define STRMODE_LEN 12
+#define FIELD_LEN 64
+#define NSEC_PER_SEC 1000000000L
+
+/* one entry's long-format fields, rendered before padding */
+typedef struct EntryFields {
+	char inode[FIELD_LEN];
+	char blocks[FIELD_LEN];
+	char nlink[FIELD_LEN];
+	char user[FIELD_LEN];
+	char group[FIELD_LEN];
+	char size[FIELD_LEN];
+	int user_min;
+	int group_min;
+	int size_min;
+} EntryFields;
+
+int nameComp(const FTSENT **, const FTSENT **);
+int sizeComp(const FTSENT **, const FTSENT **);
+int mtimeComp(const FTSENT **, const FTSENT **);
+void formatHumanReadable(char *, size_t, uint64_t);
+void formatUserAndGroup(EntryFields *, const struct stat *);
+void printFileTime(FILE *, const struct stat *, const Options *);
+char *getModifiedName(const char *, const Options *);
+int growBuffer(void *, size_t *, size_t, size_t);
+int writeFully(int, const void *, size_t);
+
+#endif /* LS_INTERNAL_H */
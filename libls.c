@@ -0,0 +1,124 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+/*
+ * In-process entry point for the listing code. Unlike the ls binary
+ * this never prints or exits: entries go to the caller's callback and
+ * failures come back as return values. The walk never changes the
+ * working directory, and its state lives in the Options and on the
+ * stack, so separate threads may iterate at once. A recursive walk
+ * starts read-ahead threads, which only warm the cache and are joined
+ * before lsIterate() returns; the callback always runs on the calling
+ * thread. printEntry() shares name caches and is not safe to call from
+ * several threads.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "helpers.h"
+#include "libls.h"
+
+typedef struct CallbackSink {
+	EntrySink sink;
+	LsCallback callback;
+	void *arg;
+} CallbackSink;
+
+static int
+emitToCallback(EntrySink *sink, const LsEntry *ent)
+{
+	CallbackSink *csink = sink->state;
+
+	return csink->callback(ent, csink->arg);
+}
+
+/* modes that write files or never list, which the library does not do */
+static int
+listingOnly(const Options *ls_options)
+{
+	return ls_options->checkpoint_file == NULL && 
+	    !ls_options->resume_checkpoint &&
+	    ls_options->snapshot_file == NULL && 
+	    ls_options->diff_file == NULL &&
+	    ls_options->estimate_probes == 0 && 
+	    ls_options->server_socket == NULL &&
+	    ls_options->client_socket == NULL && 
+	    !ls_options->dedup_links && !ls_options->idle_priority;
+}
+
+/*
+ * Walk paths (or "." if there are none) with the given options.
+ * Returns 0 when the walk completes, -1 with errno set if the
+ * traversal fails, or the value the callback returned to stop early.
+ * Options for anything but a listing fail with EINVAL.
+ */
+int
+lsIterate(char **paths, const Options *ls_options, LsCallback callback,
+	void *arg)
+{
+	char *local_default[2] = {".", NULL};
+	CallbackSink csink;
+	Throttle throttle;
+	Options walk_options;
+
+	if (!listingOnly(ls_options)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	csink.sink.emit = emitToCallback;
+	csink.sink.sync = NULL;
+	csink.sink.pending = NULL;
+	csink.sink.state = &csink;
+	csink.callback = callback;
+	csink.arg = arg;
+
+	if (paths == NULL || paths[0] == NULL) {
+		paths = local_default;
+	}
+
+	walk_options = *ls_options;
+	walk_options.keep_cwd = 1;
+
+	/* --gentle limits apply, but nothing is reported afterwards */
+	initThrottle(&throttle, walk_options.gentle_stats,
+	    walk_options.gentle_dirs);
+
+	if (walk_options.list_dir_recursive) {
+		return traverseRecursive(paths, &walk_options, &csink.sink,
+		    &throttle);
+	}
+
+	return traverseShallow(paths, &walk_options, &csink.sink, &throttle);
+}
@@ -0,0 +1,241 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+/*
+ * Hard link bookkeeping for --dedup-links. Only files with more than
+ * one link ever reach the set, and each is kept as a single 64-bit key:
+ * a 16-bit device number, assigned in order of first appearance, above
+ * the low 48 bits of the inode. Keys live in an open-addressing table
+ * with linear probing, grown by doubling once it would pass three
+ * quarters full, so a tracked file costs between 8 / 0.75 = 10.7 bytes
+ * and twice that just after a doubling, while the old table is briefly
+ * held as well. Inodes too large for 48 bits, or more than 65535
+ * devices, fall back to a table of full pairs.
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "linkset.h"
+
+#define INODE_BITS 48
+#define INODE_MASK ((UINT64_C(1) << INODE_BITS) - 1)
+#define MAX_DEVS 0xffff
+#define SLOTS_START 1024
+#define HASH_MULT UINT64_C(0x9e3779b97f4a7c15)
+
+/* three quarters full, the most linear probing copes with well */
+#define OVER_LOAD(count, nslots) ((count) * 4 > (nslots) * 3)
+
+void
+initLinkSet(LinkSet *set)
+{
+	memset(set, 0, sizeof(*set));
+}
+
+void
+freeLinkSet(LinkSet *set)
+{
+	free(set->slots);
+	free(set->devs);
+	free(set->overflow);
+	memset(set, 0, sizeof(*set));
+}
+
+static size_t
+slotFor(uint64_t key, size_t nslots)
+{
+	return (size_t)((key * HASH_MULT) >> 17) & (nslots - 1);
+}
+
+/* device index plus one, or 0 once there are too many to index */
+static uint64_t
+deviceIndex(LinkSet *set, dev_t dev)
+{
+	dev_t *grown = NULL;
+	size_t cap = 0;
+	size_t i = 0;
+
+	/* few devices turn up in one listing, so a scan will do */
+	for (i = 0; i < set->ndevs; i++) {
+		if (set->devs[i] == dev) {
+			return i + 1;
+		}
+	}
+
+	if (set->ndevs == MAX_DEVS) {
+		return 0;
+	}
+
+	if (set->ndevs == set->devs_cap) {
+		cap = set->devs_cap == 0 ? 8 : set->devs_cap * 2;
+		if ((grown = realloc(set->devs, cap * sizeof(*grown))) == NULL) {
+			return 0;
+		}
+		set->devs = grown;
+		set->devs_cap = cap;
+	}
+
+	set->devs[set->ndevs++] = dev;
+
+	return set->ndevs;
+}
+
+static int
+growKeys(LinkSet *set)
+{
+	uint64_t *old = set->slots;
+	size_t old_slots = set->nslots;
+	size_t nslots = old_slots == 0 ? SLOTS_START : old_slots * 2;
+	size_t slot = 0;
+	size_t i = 0;
+
+	if ((set->slots = calloc(nslots, sizeof(*set->slots))) == NULL) {
+		set->slots = old;
+		return -1;
+	}
+	set->nslots = nslots;
+
+	for (i = 0; i < old_slots; i++) {
+		if (old[i] == 0) {
+			continue;
+		}
+		for (slot = slotFor(old[i], nslots); set->slots[slot] != 0;
+		    slot = (slot + 1) & (nslots - 1)) {
+			continue;
+		}
+		set->slots[slot] = old[i];
+	}
+
+	free(old);
+
+	return 0;
+}
+
+static int
+growOverflow(LinkSet *set)
+{
+	LinkPair *old = set->overflow;
+	size_t old_slots = set->overflow_slots;
+	size_t nslots = old_slots == 0 ? 64 : old_slots * 2;
+	size_t slot = 0;
+	size_t i = 0;
+
+	if ((set->overflow = calloc(nslots, sizeof(*set->overflow))) == NULL) {
+		set->overflow = old;
+		return -1;
+	}
+	set->overflow_slots = nslots;
+
+	for (i = 0; i < old_slots; i++) {
+		if (!old[i].used) {
+			continue;
+		}
+		for (slot = slotFor((uint64_t)old[i].ino ^ (uint64_t)old[i].dev,
+		    nslots); set->overflow[slot].used;
+		    slot = (slot + 1) & (nslots - 1)) {
+			continue;
+		}
+		set->overflow[slot] = old[i];
+	}
+
+	free(old);
+
+	return 0;
+}
+
+static int
+overflowSeen(LinkSet *set, dev_t dev, ino_t ino)
+{
+	LinkPair *pair = NULL;
+	size_t slot = 0;
+
+	if (OVER_LOAD(set->overflow_count + 1, set->overflow_slots) &&
+	    growOverflow(set) != 0) {
+		return -1;
+	}
+
+	for (slot = slotFor((uint64_t)ino ^ (uint64_t)dev,
+	    set->overflow_slots); set->overflow[slot].used;
+	    slot = (slot + 1) & (set->overflow_slots - 1)) {
+		pair = &set->overflow[slot];
+		if (pair->dev == dev && pair->ino == ino) {
+			return 1;
+		}
+	}
+
+	set->overflow[slot].dev = dev;
+	set->overflow[slot].ino = ino;
+	set->overflow[slot].used = 1;
+	++set->overflow_count;
+
+	return 0;
+}
+
+/*
+ * Returns 1 if the pair was already in the set, 0 if it has just been
+ * added, or -1 if there was no memory to add it.
+ */
+int
+linkSeen(LinkSet *set, dev_t dev, ino_t ino)
+{
+	uint64_t index = 0;
+	uint64_t key = 0;
+	size_t slot = 0;
+
+	if ((uint64_t)ino > INODE_MASK ||
+	    (index = deviceIndex(set, dev)) == 0) {
+		return overflowSeen(set, dev, ino);
+	}
+
+	key = (index << INODE_BITS) | (uint64_t)ino;
+
+	if (OVER_LOAD(set->count + 1, set->nslots) && growKeys(set) != 0) {
+		return -1;
+	}
+
+	for (slot = slotFor(key, set->nslots); set->slots[slot] != 0;
+	    slot = (slot + 1) & (set->nslots - 1)) {
+		if (set->slots[slot] == key) {
+			return 1;
+		}
+	}
+
+	set->slots[slot] = key;
+	++set->count;
+
+	return 0;
+}
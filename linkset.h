@@ -0,0 +1,68 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef LS_LINKSET_H
+#define LS_LINKSET_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct LinkPair {
+	dev_t dev;
+	ino_t ino;
+	int used;
+} LinkPair;
+
+/*
+ * Set of (device, inode) pairs already counted. Most pairs pack into
+ * one 64-bit key; the rest go to a slower overflow table.
+ */
+typedef struct LinkSet {
+	uint64_t *slots;	/* 0 marks an empty slot */
+	size_t nslots;
+	size_t count;
+	dev_t *devs;		/* device index, plus one, is a key's top bits */
+	size_t ndevs;
+	size_t devs_cap;
+	LinkPair *overflow;
+	size_t overflow_slots;
+	size_t overflow_count;
+} LinkSet;
+
+void initLinkSet(LinkSet *);
+int linkSeen(LinkSet *, dev_t, ino_t);
+void freeLinkSet(LinkSet *);
+
+#endif /* LS_LINKSET_H */
@@ -0,0 +1,494 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+/*
+ * Three-stage listing pipeline: the calling thread walks the tree and
+ * fills batches of entries, a formatter thread turns each batch into
+ * a chunk of text, and a writer thread pushes chunks to the output.
+ * Stages are connected by bounded single-producer/single-consumer
+ * rings, so throughput is set by the slowest stage rather than the
+ * sum of all three.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "helpers.h"
+#include "pipeline.h"
+#include "print.h"
+
+#define QUEUE_SLOTS 8		/* must be a power of two */
+#define CACHE_LINE 64
+#define BATCH_ENTRIES 256
+#define BATCH_ARENA (64 * 1024)
+#define SPIN_LIMIT 64
+#define BACKOFF_NSEC 50000
+
+/* 
+ * The producer only ever writes tail and the consumer only ever
+ * writes head, so acquire/release ordering on the indices is all
+ * the synchronization the ring needs.
+ */
+typedef struct SpscQueue {
+	void *slots[QUEUE_SLOTS];
+	char pad_head[CACHE_LINE];
+	unsigned long head;
+	char pad_tail[CACHE_LINE];
+	unsigned long tail;
+} SpscQueue;
+
+typedef struct EntryBatch {
+	size_t count;
+	size_t used;
+	size_t arena_size;
+	char *arena;
+	LsEntry entries[BATCH_ENTRIES];
+	struct stat stats[BATCH_ENTRIES];
+} EntryBatch;
+
+typedef struct OutChunk {
+	char *buf;
+	size_t len;
+} OutChunk;
+
+struct Pipeline {
+	EntrySink sink;
+	FILE *out;
+	const Options *ls_options;
+	EntryBatch *current;
+	SpscQueue to_format;	/* traversal -> formatter, filled batches */
+	SpscQueue to_reuse;	/* formatter -> traversal, spent batches */
+	SpscQueue to_write;	/* formatter -> writer, text chunks */
+	pthread_t formatter;
+	pthread_t writer;
+	int format_errno;	/* set by the stages, polled by emit */
+	int write_errno;
+};
+
+static void
+backoff(unsigned *spins)
+{
+	struct timespec pause;
+
+	if (++(*spins) < SPIN_LIMIT) {
+		(void)sched_yield();
+		return;
+	}
+
+	/* other side is stuck on I/O, stop burning a core on it */
+	pause.tv_sec = 0;
+	pause.tv_nsec = BACKOFF_NSEC;
+	(void)nanosleep(&pause, NULL);
+}
+
+static int
+queueTryPush(SpscQueue *queue, void *item)
+{
+	unsigned long tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+	unsigned long head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+	if (tail - head == QUEUE_SLOTS) {
+		return 0;
+	}
+
+	queue->slots[tail & (QUEUE_SLOTS - 1)] = item;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+static int
+queueTryPop(SpscQueue *queue, void **item)
+{
+	unsigned long head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+	unsigned long tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail) {
+		return 0;
+	}
+
+	*item = queue->slots[head & (QUEUE_SLOTS - 1)];
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+static void
+queuePush(SpscQueue *queue, void *item)
+{
+	unsigned spins = 0;
+
+	while (!queueTryPush(queue, item)) {
+		backoff(&spins);
+	}
+}
+
+static void *
+queuePop(SpscQueue *queue)
+{
+	void *item = NULL;
+	unsigned spins = 0;
+
+	while (!queueTryPop(queue, &item)) {
+		backoff(&spins);
+	}
+
+	return item;
+}
+
+static void
+freeBatch(EntryBatch *batch)
+{
+	free(batch->arena);
+	free(batch);
+}
+
+static EntryBatch *
+getBatch(Pipeline *pipeline, size_t need)
+{
+	EntryBatch *batch = NULL;
+	void *spent = NULL;
+	size_t arena_size = BATCH_ARENA;
+
+	if (need <= BATCH_ARENA && queueTryPop(&pipeline->to_reuse, &spent)) {
+		batch = spent;
+		batch->count = 0;
+		batch->used = 0;
+		return batch;
+	}
+
+	/* a lone oversized entry gets a one-off batch of its own */
+	if (need > arena_size) {
+		arena_size = need;
+	}
+
+	if ((batch = malloc(sizeof(*batch))) == NULL) {
+		return NULL;
+	}
+
+	if ((batch->arena = malloc(arena_size)) == NULL) {
+		free(batch);
+		return NULL;
+	}
+
+	batch->count = 0;
+	batch->used = 0;
+	batch->arena_size = arena_size;
+
+	return batch;
+}
+
+static void
+recycleBatch(Pipeline *pipeline, EntryBatch *batch)
+{
+	/* never block here, the traversal may be waiting on us */
+	if (batch->arena_size != BATCH_ARENA || 
+	    !queueTryPush(&pipeline->to_reuse, batch)) {
+		freeBatch(batch);
+	}
+}
+
+static size_t
+stringSpace(const char *str)
+{
+	return str == NULL ? 0 : strlen(str) + 1;
+}
+
+static const char *
+arenaCopy(EntryBatch *batch, const char *str)
+{
+	char *dst = NULL;
+	size_t len = 0;
+
+	if (str == NULL) {
+		return NULL;
+	}
+
+	len = strlen(str) + 1;
+	dst = batch->arena + batch->used;
+	memcpy(dst, str, len);
+	batch->used += len;
+
+	return dst;
+}
+
+/* errors are written by one stage and polled by the traversal */
+static void
+setError(int *error)
+{
+	__atomic_store_n(error, errno, __ATOMIC_RELAXED);
+}
+
+static int
+emitToPipeline(EntrySink *sink, const LsEntry *ent)
+{
+	Pipeline *pipeline = sink->state;
+	EntryBatch *batch = pipeline->current;
+	LsEntry *copy = NULL;
+	size_t need = 0;
+	int failed = 0;
+
+	/* once output has failed, there is no point walking further */
+	if ((failed = __atomic_load_n(&pipeline->write_errno, 
+	    __ATOMIC_RELAXED)) != 0 || (failed = __atomic_load_n(
+	    &pipeline->format_errno, __ATOMIC_RELAXED)) != 0) {
+		errno = failed;
+		return -1;
+	}
+
+	need = stringSpace(ent->name) + stringSpace(ent->link_target);
+	if (ent->accpath != ent->name) {
+		need += stringSpace(ent->accpath);
+	}
+
+	if (batch->count == BATCH_ENTRIES || 
+	    batch->arena_size - batch->used < need) {
+		queuePush(&pipeline->to_format, batch);
+		if ((batch = pipeline->current = getBatch(pipeline, need)) 
+		    == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	copy = &batch->entries[batch->count];
+	*copy = *ent;
+
+	if (ent->statp != NULL) {
+		batch->stats[batch->count] = *ent->statp;
+		copy->statp = &batch->stats[batch->count];
+	}
+
+	copy->name = arenaCopy(batch, ent->name);
+	if (ent->accpath == ent->name) {
+		copy->accpath = copy->name;
+	} else {
+		copy->accpath = arenaCopy(batch, ent->accpath);
+	}
+	copy->link_target = arenaCopy(batch, ent->link_target);
+
+	batch->count++;
+
+	return 0;
+}
+
+static void *
+formatStage(void *arg)
+{
+	Pipeline *pipeline = arg;
+	EntryBatch *batch = NULL;
+	OutChunk *chunk = NULL;
+	FILE *text = NULL;
+	Printer printer;
+	size_t i = 0;
+
+	/* the printer outlives batches so a directory can span several */
+	initPrinter(&printer, pipeline->out, pipeline->ls_options);
+
+	while ((batch = queuePop(&pipeline->to_format)) != NULL) {
+		/* after a failure keep draining so the traversal never stalls */
+		if (pipeline->format_errno != 0) {
+			recycleBatch(pipeline, batch);
+			continue;
+		}
+
+		if ((chunk = malloc(sizeof(*chunk))) == NULL) {
+			setError(&pipeline->format_errno);
+			recycleBatch(pipeline, batch);
+			continue;
+		}
+
+		if ((text = open_memstream(&chunk->buf, &chunk->len)) == NULL) {
+			setError(&pipeline->format_errno);
+			free(chunk);
+			recycleBatch(pipeline, batch);
+			continue;
+		}
+
+		printer.out = text;
+		for (i = 0; i < batch->count; i++) {
+			printerAdd(&printer, &batch->entries[i]);
+		}
+
+		if (fclose(text) != 0) {
+			setError(&pipeline->format_errno);
+			free(chunk->buf);
+			free(chunk);
+		} else {
+			queuePush(&pipeline->to_write, chunk);
+		}
+
+		recycleBatch(pipeline, batch);
+	}
+
+	/* whatever the printer still holds goes out as the last chunk */
+	if (pipeline->format_errno == 0 && 
+	    (chunk = malloc(sizeof(*chunk))) != NULL) {
+		if ((text = open_memstream(&chunk->buf, &chunk->len)) == NULL) {
+			setError(&pipeline->format_errno);
+			free(chunk);
+		} else {
+			printer.out = text;
+			flushPrinter(&printer);
+			printTotals(&printer);
+			if (fclose(text) != 0) {
+				setError(&pipeline->format_errno);
+				free(chunk->buf);
+				free(chunk);
+			} else {
+				queuePush(&pipeline->to_write, chunk);
+			}
+		}
+	} else if (pipeline->format_errno == 0) {
+		setError(&pipeline->format_errno);
+	}
+	freePrinter(&printer);
+
+	/* pass end of stream along to the writer */
+	queuePush(&pipeline->to_write, NULL);
+
+	return NULL;
+}
+
+static void *
+writeStage(void *arg)
+{
+	Pipeline *pipeline = arg;
+	OutChunk *chunk = NULL;
+
+	while ((chunk = queuePop(&pipeline->to_write)) != NULL) {
+		if (pipeline->write_errno == 0 && chunk->len > 0 &&
+		    fwrite(chunk->buf, 1, chunk->len, pipeline->out) != chunk->len) {
+			setError(&pipeline->write_errno);
+		}
+
+		free(chunk->buf);
+		free(chunk);
+	}
+
+	if (fflush(pipeline->out) != 0 && pipeline->write_errno == 0) {
+		setError(&pipeline->write_errno);
+	}
+
+	return NULL;
+}
+
+Pipeline *
+startPipeline(FILE *out, const Options *ls_options)
+{
+	Pipeline *pipeline = NULL;
+	int error = 0;
+
+	if ((pipeline = calloc(1, sizeof(*pipeline))) == NULL) {
+		return NULL;
+	}
+
+	pipeline->sink.emit = emitToPipeline;
+	pipeline->sink.sync = NULL;
+	pipeline->sink.pending = NULL;
+	pipeline->sink.state = pipeline;
+	pipeline->out = out;
+	pipeline->ls_options = ls_options;
+
+	if ((pipeline->current = getBatch(pipeline, 0)) == NULL) {
+		free(pipeline);
+		return NULL;
+	}
+
+	if ((error = pthread_create(&pipeline->formatter, NULL, formatStage, 
+	    pipeline)) != 0) {
+		freeBatch(pipeline->current);
+		free(pipeline);
+		errno = error;
+		return NULL;
+	}
+
+	if ((error = pthread_create(&pipeline->writer, NULL, writeStage, 
+	    pipeline)) != 0) {
+		/* formatter is already running, so shut it down cleanly */
+		queuePush(&pipeline->to_format, NULL);
+		(void)pthread_join(pipeline->formatter, NULL);
+		freeBatch(pipeline->current);
+		free(pipeline);
+		errno = error;
+		return NULL;
+	}
+
+	return pipeline;
+}
+
+EntrySink *
+pipelineSink(Pipeline *pipeline)
+{
+	return &pipeline->sink;
+}
+
+int
+finishPipeline(Pipeline *pipeline)
+{
+	void *spent = NULL;
+	int write_errno = 0;
+
+	if (pipeline->current != NULL && pipeline->current->count > 0) {
+		queuePush(&pipeline->to_format, pipeline->current);
+	} else if (pipeline->current != NULL) {
+		freeBatch(pipeline->current);
+	}
+	queuePush(&pipeline->to_format, NULL);
+
+	(void)pthread_join(pipeline->formatter, NULL);
+	(void)pthread_join(pipeline->writer, NULL);
+
+	while (queueTryPop(&pipeline->to_reuse, &spent)) {
+		freeBatch(spent);
+	}
+
+	write_errno = pipeline->format_errno != 0 ?
+	    pipeline->format_errno : pipeline->write_errno;
+	free(pipeline);
+
+	if (write_errno != 0) {
+		errno = write_errno;
+		return -1;
+	}
+
+	return 0;
+}
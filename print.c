@@ -31,10 +31,11 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 */
 
+#include <sys/ioctl.h>
+
 #include <ctype.h>
 #include <errno.h>
 #include <grp.h>
-#include <limits.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -42,13 +43,56 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <time.h>
 #include <unistd.h>
 
+#include "color.h"
+#include "internal.h"
 #include "print.h"
 
-#define STRMODE_LEN 12
 #define TMESG_SIZE 512
+#define ID_CACHE_SLOTS 256
+#define ID_NAME_LEN 33
+#define NLINK_MIN 2
+#define COLUMN_GAP 2
+#define GROUP_ROWS 4096		/* entries aligned together at most */
+#define DEFAULT_TERM_WIDTH 80
 
-static void
-printHumanReadable(unsigned long size)
+enum IdCacheState {
+	ID_EMPTY = 0,
+	ID_NAMED,
+	ID_UNKNOWN
+};
+
+typedef struct IdCacheSlot {
+	unsigned long id;
+	int state;
+	char name[ID_NAME_LEN];
+} IdCacheSlot;
+
+/* 
+ * Buffered copy of an entry. Its strings, including the rendered
+ * fields, live in the printer's arena so they are formatted only once.
+ */
+struct TableRow {
+	LsEntry ent;
+	struct stat sb;
+	size_t name_off;
+	size_t accpath_off;
+	size_t link_off;
+	size_t fields_off;
+	int user_min;
+	int group_min;
+	int size_min;
+};
+
+#define NO_LINK ((size_t)-1)
+
+static IdCacheSlot user_cache[ID_CACHE_SLOTS];
+static IdCacheSlot group_cache[ID_CACHE_SLOTS];
+
+/* with no table to measure, pad to the historical fixed widths */
+static const ColumnWidths legacy_widths = {0, 0, 0, 0, 0, 0, 0};
+
+void
+formatHumanReadable(char *buf, size_t len, uint64_t size)
 {
 	static const size_t SUFF_LEN = 9;
 	static const char suffixes[] = {'B', 'K', 'M', 'G', 'T', 
@@ -60,23 +104,41 @@ printHumanReadable(unsigned long size)
 	float fsize = (float)size;
 	size_t index = 0;
 
+	buf[0] = '\0';
+
 	while (fsize > scale_cutoff) {
 		fsize /= scale;
 		++index;
 	}
 
+	/* cannot happen for a 64-bit size, but never index past Y */
 	if (index > SUFF_LEN - 1) {
-		fprintf(stderr, "file size too large to scale\n");
 		return;
 	}
 
 	if (fsize > print_cutoff) {
-		printf("%.0f%c ", fsize, suffixes[index]);
+		(void)snprintf(buf, len, "%.0f%c", fsize, suffixes[index]);
 	} else {
-		printf("%.1f%c ", fsize, suffixes[index]);
+		(void)snprintf(buf, len, "%.1f%c", fsize, suffixes[index]);
 	}
 }
 
+/* decimal, since C89 printf has no conversion for 64 bits */
+static void
+formatCount(char *buf, size_t len, uint64_t value)
+{
+	char digits[21];
+	size_t pos = sizeof(digits) - 1;
+
+	digits[pos] = '\0';
+	do {
+		digits[--pos] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value != 0);
+
+	(void)snprintf(buf, len, "%s", digits + pos);
+}
+
 /* 
  * NOTE: on BSD, ls -sh prints file size in human format,
  * rather than block size? However ls -lsh prints blocksize
@@ -84,51 +146,102 @@ printHumanReadable(unsigned long size)
  * both cases, since this seems less surprising. 
  */
 static void
-printBlockSize(unsigned long blocks, long user_bsize, 
-		const Options *ls_options)
+formatBlockSize(char *buf, size_t len, uint64_t blocks, 
+		long user_bsize, const Options *ls_options)
 {
-	const unsigned long stat_bsize = 512;
-	unsigned long file_blocks = 0;
+	const uint64_t stat_bsize = 512;
+	uint64_t file_blocks = 0;
 
 	if (ls_options->human_readable) {
-		printHumanReadable(blocks * stat_bsize);
+		formatHumanReadable(buf, len, blocks * stat_bsize);
 		return;
 	}
 
 	file_blocks = blocks * stat_bsize;
-	file_blocks /= user_bsize;
-	printf("%lu ", file_blocks);
+	file_blocks /= (uint64_t)user_bsize;
+	formatCount(buf, len, file_blocks);
 }
 
 static void
-printDevSize(const struct stat *sb)
+formatDevSize(char *buf, size_t len, const struct stat *sb)
 {
-	printf("%2d,%2d ", major(sb->st_rdev), minor(sb->st_rdev));
+	(void)snprintf(buf, len, "%2d,%2d", major(sb->st_rdev), 
+	    minor(sb->st_rdev));
 }
 
-static void
-printUserAndGroup(const struct stat *sb)
+/* 
+ * Entries in a directory tend to share a handful of owners, so cache
+ * name lookups rather than going back to NSS for every file. Only one
+ * thread formats at a time, so the tables need no locking.
+ */
+static const char *
+cachedIdName(IdCacheSlot *cache, unsigned long id, int is_group)
 {
+	IdCacheSlot *slot = &cache[id % ID_CACHE_SLOTS];
 	struct passwd *pass = NULL;
 	struct group *grp = NULL;
+	const char *name = NULL;
+
+	if (slot->state != ID_EMPTY && slot->id == id) {
+		return slot->state == ID_NAMED ? slot->name : NULL;
+	}
+
+	if (is_group) {
+		if ((grp = getgrgid((gid_t)id)) != NULL) {
+			name = grp->gr_name;
+		}
+	} else {
+		if ((pass = getpwuid((uid_t)id)) != NULL) {
+			name = pass->pw_name;
+		}
+	}
+
+	/* overlong names are rare enough to just look up every time */
+	if (name != NULL && strlen(name) >= ID_NAME_LEN) {
+		return name;
+	}
 
-	if ((pass = getpwuid(sb->st_uid)) == NULL) {
+	slot->id = id;
+	if (name == NULL) {
+		slot->state = ID_UNKNOWN;
+	} else {
+		slot->state = ID_NAMED;
+		(void)strlcpy(slot->name, name, ID_NAME_LEN);
+	}
+
+	return name;
+}
+
+void
+formatUserAndGroup(EntryFields *fields, const struct stat *sb)
+{
+	const char *user = NULL;
+	const char *group = NULL;
+
+	/* names were historically padded to 5, numeric ids to 4 */
+	if ((user = cachedIdName(user_cache, sb->st_uid, 0)) == NULL) {
 		/* fallback to numeric uid */
-		printf("%4u ", (unsigned)sb->st_uid);
+		(void)snprintf(fields->user, FIELD_LEN, "%u", 
+		    (unsigned)sb->st_uid);
+		fields->user_min = 4;
 	} else {
-		printf("%5s ", pass->pw_name);
+		(void)snprintf(fields->user, FIELD_LEN, "%s", user);
+		fields->user_min = 5;
 	}
 
-	if ((grp = getgrgid(sb->st_gid)) == NULL) {
+	if ((group = cachedIdName(group_cache, sb->st_gid, 1)) == NULL) {
 		/* fallback to numeric uid */
-		printf("%4u ", (unsigned)sb->st_gid);
+		(void)snprintf(fields->group, FIELD_LEN, "%u", 
+		    (unsigned)sb->st_gid);
+		fields->group_min = 4;
 	} else {
-		printf("%5s ", grp->gr_name);
+		(void)snprintf(fields->group, FIELD_LEN, "%s", group);
+		fields->group_min = 5;
 	}
 }
 
-static void
-printFileTime(struct stat *sb, const Options *ls_options)
+void
+printFileTime(FILE *out, const struct stat *sb, const Options *ls_options)
 {
 	time_t ftime;
 	time_t ctime;
@@ -139,9 +252,6 @@ printFileTime(struct stat *sb, const Options *ls_options)
 	const char format_year[] = "%b %e %Y";
 	char tmsg[TMESG_SIZE];
 
-	/* will fall back to GMT if TZ var is garbage */
-	tzset();
-
 	if (ls_options->sort_by_ctime) {
 		ftime = sb->st_ctime;
 	} else if (ls_options->sort_by_atime) {
@@ -151,21 +261,21 @@ printFileTime(struct stat *sb, const Options *ls_options)
 		ftime = sb->st_mtime;
 	}
 
+	/* printing is shared with libls, so failures just blank the time */
 	if (localtime_r(&ftime, &tdata) == NULL) {
-		fprintf(stderr, "invalid time: %s\n", 
-			strerror(errno));
+		fprintf(out, " ");
+		return;
 	}
 
 	if (clock_gettime(CLOCK_REALTIME, &clock_time) != 0) {
-		printf(" ");
+		fprintf(out, " ");
 		return;
 	}
 
 	ctime = (time_t)clock_time.tv_sec;	
 	if (localtime_r(&ctime, &tcurr) == NULL) {
-		fprintf(stderr, "invalid time: %s\n",
-			strerror(errno));
-		exit(EXIT_FAILURE);
+		fprintf(out, " ");
+		return;
 	}
 
 /* Wpedantic + Wformat warning complains about '%e' but this is fine */
@@ -174,19 +284,19 @@ printFileTime(struct stat *sb, const Options *ls_options)
 	if (tdata.tm_year != tcurr.tm_year) {
 		if (strftime(tmsg, TMESG_SIZE, format_year, &tdata) == 0) {
 			/* avoid printing time if format errors */
-			printf(" ");
+			fprintf(out, " ");
 			return;
 		}
 	} else {
 		if (strftime(tmsg, TMESG_SIZE, format_curr, &tdata) == 0) {
 			/* avoid printing time if format errors */
-			printf(" ");
+			fprintf(out, " ");
 			return;
 		}
 	}
 #pragma GCC diagnostic pop
 
-	printf("%s ", tmsg);
+	fprintf(out, "%s ", tmsg);
 }
 
 static int
@@ -196,34 +306,89 @@ isDevice(mode_t fmode)
 }
 
 static void
-printLongFormat(FTSENT *fts_ent, const Options *ls_options)
+fillFields(EntryFields *fields, const LsEntry *ent, long user_bsize,
+		const Options *ls_options)
 {
-	char fmode[STRMODE_LEN];
-	struct stat *sb = fts_ent->fts_statp;
+	const struct stat *sb = ent->statp;
 
-	strmode(sb->st_mode, fmode);
-	printf("%11s ", fmode);
+	/* fields an option leaves out are empty, not garbage */
+	fields->inode[0] = '\0';
+	fields->blocks[0] = '\0';
+	fields->nlink[0] = '\0';
+	fields->user[0] = '\0';
+	fields->group[0] = '\0';
+	fields->size[0] = '\0';
+	fields->user_min = 0;
+	fields->group_min = 0;
+	fields->size_min = 0;
+
+	if (ls_options->print_inode) {
+		(void)snprintf(fields->inode, FIELD_LEN, "%ld", 
+		    (long)sb->st_ino);
+	}
+
+	if (ls_options->print_bsize) {
+		formatBlockSize(fields->blocks, FIELD_LEN, 
+		    (unsigned long)sb->st_blocks, user_bsize, ls_options);
+	}
+
+	if (!ls_options->print_long_format) {
+		return;
+	}
+
+	(void)snprintf(fields->nlink, FIELD_LEN, "%u", 
+	    (unsigned)sb->st_nlink);
 
-	printf("%2u ", (unsigned)sb->st_nlink);
-	
 	if (ls_options->print_numeric_uid_gid) {
-		printf("%4u %4u ", (unsigned)sb->st_uid, 
-			(unsigned)sb->st_gid);	
+		(void)snprintf(fields->user, FIELD_LEN, "%u", 
+		    (unsigned)sb->st_uid);
+		(void)snprintf(fields->group, FIELD_LEN, "%u", 
+		    (unsigned)sb->st_gid);
+		fields->user_min = 4;
+		fields->group_min = 4;
 	} else {
-		printUserAndGroup(sb);
+		formatUserAndGroup(fields, sb);
 	}
 
+	fields->size_min = 0;
 	if (isDevice(sb->st_mode)) {
-		printDevSize(sb);
+		formatDevSize(fields->size, FIELD_LEN, sb);
+	} else if (ls_options->human_readable) {
+		formatHumanReadable(fields->size, FIELD_LEN, 
+		    (unsigned long)sb->st_size);
 	} else {
-		if (ls_options->human_readable) {
-			printHumanReadable((unsigned long)sb->st_size);
-		} else {
-			printf("%5lu ", (unsigned long)sb->st_size);
-		}
+		(void)snprintf(fields->size, FIELD_LEN, "%lu", 
+		    (unsigned long)sb->st_size);
+		fields->size_min = 5;
 	}
+}
+
+static int
+fieldWidth(int min, int measured)
+{
+	return measured > min ? measured : min;
+}
+
+static void
+printLongFormat(FILE *out, const LsEntry *ent, const EntryFields *fields,
+		const ColumnWidths *widths, const Options *ls_options)
+{
+	char fmode[STRMODE_LEN];
+	const struct stat *sb = ent->statp;
+
+	strmode(sb->st_mode, fmode);
+	fprintf(out, "%11s ", fmode);
 
-	printFileTime(sb, ls_options);
+	fprintf(out, "%*s ", fieldWidth(NLINK_MIN, widths->nlink), 
+	    fields->nlink);
+	fprintf(out, "%*s ", fieldWidth(fields->user_min, widths->user), 
+	    fields->user);
+	fprintf(out, "%*s ", fieldWidth(fields->group_min, widths->group), 
+	    fields->group);
+	fprintf(out, "%*s ", fieldWidth(fields->size_min, widths->size), 
+	    fields->size);
+
+	printFileTime(out, sb, ls_options);
 }
 
 char *
@@ -256,86 +421,662 @@ getModifiedName(const char *src_name, const Options *ls_options)
 }
 
 static int
-isDirHeader(const FTSENT *fts_ent, const Options *ls_options)
+isDirHeader(const LsEntry *ent, const Options *ls_options)
 {
-	return (fts_ent->fts_info == FTS_D && 
-    	       	fts_ent->fts_level == 0    &&
+	return (ent->info == FTS_D && 
+    	       	ent->level == 0    &&
     	       	!ls_options->plain_dirs);
 }
 
-static void
-printFileName(const FTSENT *fts_ent, const Options *ls_options)
+static char
+fileTypeChar(const LsEntry *ent, const Options *ls_options)
 {
-	struct stat *sb = fts_ent->fts_statp;
+	const struct stat *sb = ent->statp;
 	const mode_t exec_comp = S_IXUSR | S_IXGRP | S_IXOTH;
-	const char *working_name = isDirHeader(fts_ent, ls_options) ?
-					fts_ent->fts_accpath :
-					fts_ent->fts_name;
+
+	if (!ls_options->print_file_type) {
+		return '\0';
+	}
+
+	if (S_ISDIR(sb->st_mode)) {
+		return '/';
+	} else if (S_ISLNK(sb->st_mode)) {
+		return '@';
+	} else if (ent->info == FTS_W) {
+		return '%';
+	} else if (S_ISSOCK(sb->st_mode)) {
+		return '=';
+	} else if (S_ISFIFO(sb->st_mode)) {
+		return '|';
+	} else if (sb->st_mode & exec_comp) {
+		return '*';
+	}
+
+	return '\0';
+}
+
+/* escapes never count toward widths, so they are added last */
+static const char *
+nameColor(const LsEntry *ent, const Options *ls_options)
+{
+	if (ls_options->color_output != COLOR_ALWAYS || 
+	    isDirHeader(ent, ls_options)) {
+		return NULL;
+	}
+
+	return colorFor(ent);
+}
+
+/* display width of a name, which getModifiedName() never changes */
+static int
+nameWidth(const LsEntry *ent, const Options *ls_options)
+{
+	return (int)strlen(ent->name) + 
+	    (fileTypeChar(ent, ls_options) != '\0' ? 1 : 0);
+}
+
+static void
+printFileName(FILE *out, const LsEntry *ent, const Options *ls_options)
+{
+	const char *working_name = isDirHeader(ent, ls_options) ?
+					ent->accpath :
+					ent->name;
+	const char *color = nameColor(ent, ls_options);
 	char *final_name;
+	char type_char;
 
 	final_name = getModifiedName(working_name, ls_options);
 
+	if (color != NULL) {
+		fputs(color, out);
+	}
+
 	if (final_name == NULL) {
-		printf("%s", working_name);
+		fprintf(out, "%s", working_name);
 	} else {
-		printf("%s", final_name);
+		fprintf(out, "%s", final_name);
+	}
+
+	if (color != NULL) {
+		fputs(COLOR_RESET, out);
 	}
 
 	if (final_name != NULL) {
 		(void)free(final_name);
 	}
 
-	if (isDirHeader(fts_ent, ls_options)) {
-		printf(":");
-	} else if (ls_options->print_file_type) {
-		if (S_ISDIR(sb->st_mode)) {
-			printf("/ ");	
-		} else if (S_ISLNK(sb->st_mode)) {
-			printf("@ ");
-		} else if (fts_ent->fts_info == FTS_W) {
-			printf("%% ");
-		} else if (S_ISSOCK(sb->st_mode)) {
-			printf("= ");	
-		} else if (S_ISFIFO(sb->st_mode)) {
-			printf("| ");
-		} else if (sb->st_mode & exec_comp) {
-			printf("* ");
-		}
+	if (isDirHeader(ent, ls_options)) {
+		fprintf(out, ":");
+	} else if ((type_char = fileTypeChar(ent, ls_options)) != '\0') {
+		fprintf(out, "%c ", type_char);
 	}
 }
 
+static void
+printListedFile(FILE *out, const LsEntry *ent, const EntryFields *fields,
+		const ColumnWidths *widths, const Options *ls_options)
+{
+	if (ls_options->print_inode) {
+		fprintf(out, "%*s ", widths->inode, fields->inode);
+	}
+
+	if (ls_options->print_bsize) {
+		fprintf(out, "%*s ", widths->blocks, fields->blocks);
+	}
+
+	if (ls_options->print_long_format) {
+		printLongFormat(out, ent, fields, widths, ls_options);
+	}
+
+	printFileName(out, ent, ls_options);
+
+	/* link target is only resolved by the traversal in long format */
+	if (ent->link_target != NULL) {
+		fprintf(out, " -> %s", ent->link_target);
+	}
+
+	fprintf(out, "\n");
+}
+
 void 
-printEntry(FTSENT *fts_ent, long user_bsize, const Options *ls_options)
+printEntry(FILE *out, const LsEntry *ent, long user_bsize, 
+		const Options *ls_options)
+{
+	EntryFields fields;
+
+	switch (ent->kind) {
+	case ENTRY_ERROR:
+		fprintf(out, "%s: %s: %s\n", getprogname(), ent->name,
+			strerror(ent->error));
+		break;
+	case ENTRY_HEADER:
+		fprintf(out, "\n%s:\n", ent->name);
+		break;
+	case ENTRY_FILE:
+	default:
+		fillFields(&fields, ent, user_bsize, ls_options);
+		printListedFile(out, ent, &fields, &legacy_widths, 
+		    ls_options);
+		break;
+	}
+}
+
+static int
+columnMode(const Options *ls_options)
+{
+	return ls_options->print_columns && !ls_options->print_long_format;
+}
+
+static int
+terminalWidth(FILE *out)
+{
+	struct winsize win;
+	const char *columns = NULL;
+	int width = 0;
+
+	if (ioctl(fileno(out), TIOCGWINSZ, &win) == 0 && win.ws_col > 0) {
+		return win.ws_col;
+	}
+
+	if ((columns = getenv("COLUMNS")) != NULL && 
+	    (width = atoi(columns)) > 0) {
+		return width;
+	}
+
+	return DEFAULT_TERM_WIDTH;
+}
+
+void
+initPrinter(Printer *printer, FILE *out, const Options *ls_options)
+{
+	memset(printer, 0, sizeof(*printer));
+	printer->out = out;
+	printer->user_bsize = getUserBlockSize(ls_options);
+	printer->ls_options = ls_options;
+	printer->level = -1;
+	initLinkSet(&printer->links);
+
+	/* plain one-per-line output streams, anything else is aligned */
+	printer->buffered = columnMode(ls_options) ||
+	    ls_options->print_long_format || ls_options->print_inode ||
+	    ls_options->print_bsize;
+
+	if (columnMode(ls_options)) {
+		printer->term_width = terminalWidth(out);
+	}
+}
+
+static int
+maxWidth(int current, const char *field)
+{
+	int len = (int)strlen(field);
+
+	return len > current ? len : current;
+}
+
+/* fold one entry into the running widths as it is buffered */
+static void
+updateWidths(Printer *printer, const LsEntry *ent, const EntryFields *fields)
+{
+	ColumnWidths *widths = &printer->widths;
+
+	if (printer->ls_options->print_inode) {
+		widths->inode = maxWidth(widths->inode, fields->inode);
+	}
+
+	if (printer->ls_options->print_bsize) {
+		widths->blocks = maxWidth(widths->blocks, fields->blocks);
+	}
+
+	if (printer->ls_options->print_long_format) {
+		widths->nlink = maxWidth(widths->nlink, fields->nlink);
+		widths->user = maxWidth(widths->user, fields->user);
+		widths->group = maxWidth(widths->group, fields->group);
+		widths->size = maxWidth(widths->size, fields->size);
+	}
+
+	if (nameWidth(ent, printer->ls_options) > widths->name) {
+		widths->name = nameWidth(ent, printer->ls_options);
+	}
+}
+
+static size_t
+stashString(Printer *printer, const char *str)
+{
+	size_t off = printer->names_len;
+	size_t len = strlen(str) + 1;
+
+	memcpy(printer->names + off, str, len);
+	printer->names_len += len;
+
+	return off;
+}
+
+/* the six field strings go back to back, in struct order */
+static size_t
+stashFields(Printer *printer, const EntryFields *fields)
+{
+	size_t off = stashString(printer, fields->inode);
+
+	(void)stashString(printer, fields->blocks);
+	(void)stashString(printer, fields->nlink);
+	(void)stashString(printer, fields->user);
+	(void)stashString(printer, fields->group);
+	(void)stashString(printer, fields->size);
+
+	return off;
+}
+
+static const char *
+loadField(char *dst, const char *src)
+{
+	size_t len = strlen(src) + 1;
+
+	memcpy(dst, src, len);
+
+	return src + len;
+}
+
+static void
+loadFields(EntryFields *fields, const Printer *printer, const TableRow *row)
+{
+	const char *pos = printer->names + row->fields_off;
+
+	pos = loadField(fields->inode, pos);
+	pos = loadField(fields->blocks, pos);
+	pos = loadField(fields->nlink, pos);
+	pos = loadField(fields->user, pos);
+	pos = loadField(fields->group, pos);
+	(void)loadField(fields->size, pos);
+	fields->user_min = row->user_min;
+	fields->group_min = row->group_min;
+	fields->size_min = row->size_min;
+}
+
+static int
+addRow(Printer *printer, const LsEntry *ent, const EntryFields *fields)
 {
-	char symlink_path[PATH_MAX];
-	ssize_t plen = 0;
-	unsigned long bsize = 0;
+	TableRow *row = NULL;
+	size_t need = strlen(ent->name) + strlen(ent->accpath) + 2;
+
+	if (ent->link_target != NULL) {
+		need += strlen(ent->link_target) + 1;
+	}
+
+	need += strlen(fields->inode) + strlen(fields->blocks) +
+	    strlen(fields->nlink) + strlen(fields->user) + 
+	    strlen(fields->group) + strlen(fields->size) + 6;
+
+	if (growBuffer(&printer->rows, &printer->rows_cap, 
+	    printer->nrows + 1, sizeof(*printer->rows)) != 0 ||
+	    growBuffer(&printer->names, &printer->names_cap,
+	    printer->names_len + need, 1) != 0) {
+		return -1;
+	}
+
+	row = &printer->rows[printer->nrows++];
+	row->ent = *ent;
+	row->sb = *ent->statp;
+	row->name_off = stashString(printer, ent->name);
+	row->accpath_off = stashString(printer, ent->accpath);
+	row->link_off = ent->link_target == NULL ? NO_LINK :
+	    stashString(printer, ent->link_target);
+	row->fields_off = stashFields(printer, fields);
+	row->user_min = fields->user_min;
+	row->group_min = fields->group_min;
+	row->size_min = fields->size_min;
+
+	return 0;
+}
+
+/* the arena may have moved while filling, so point rows back into it */
+static void
+settleRows(Printer *printer)
+{
+	TableRow *row = NULL;
+	size_t i = 0;
+
+	for (i = 0; i < printer->nrows; i++) {
+		row = &printer->rows[i];
+		row->ent.statp = &row->sb;
+		row->ent.name = printer->names + row->name_off;
+		row->ent.accpath = printer->names + row->accpath_off;
+		row->ent.link_target = row->link_off == NO_LINK ? NULL :
+		    printer->names + row->link_off;
+	}
+}
+
+static void
+lineAppend(Printer *printer, const char *str, size_t len)
+{
+	if (growBuffer(&printer->line, &printer->line_cap, 
+	    printer->line_len + len, 1) != 0) {
+		return;
+	}
+
+	memcpy(printer->line + printer->line_len, str, len);
+	printer->line_len += len;
+}
+
+static void
+linePad(Printer *printer, int count)
+{
+	static const char spaces[] = "                ";
+	int chunk = 0;
+
+	while (count > 0) {
+		chunk = count < (int)sizeof(spaces) - 1 ? 
+		    count : (int)sizeof(spaces) - 1;
+		lineAppend(printer, spaces, (size_t)chunk);
+		count -= chunk;
+	}
+}
+
+/* lay out one cell and return how many columns it took up */
+static int
+appendCell(Printer *printer, const TableRow *row)
+{
+	const Options *ls_options = printer->ls_options;
+	const ColumnWidths *widths = &printer->widths;
+	const LsEntry *ent = &row->ent;
+	EntryFields fields;
+	const char *color = nameColor(ent, ls_options);
+	char *final_name = NULL;
+	char type_char = '\0';
+	int used = 0;
+
+	loadFields(&fields, printer, row);
 
 	if (ls_options->print_inode) {
-		printf("%ld ", (long)fts_ent->fts_statp->st_ino);
+		linePad(printer, widths->inode - (int)strlen(fields.inode));
+		lineAppend(printer, fields.inode, strlen(fields.inode));
+		lineAppend(printer, " ", 1);
+		used += widths->inode + 1;
 	}
 
 	if (ls_options->print_bsize) {
-		bsize = (unsigned long)fts_ent->fts_statp->st_blocks;
-		printBlockSize(bsize, user_bsize, ls_options);
+		linePad(printer, widths->blocks - (int)strlen(fields.blocks));
+		lineAppend(printer, fields.blocks, strlen(fields.blocks));
+		lineAppend(printer, " ", 1);
+		used += widths->blocks + 1;
 	}
 
-	if (ls_options->print_long_format) {
-		printLongFormat(fts_ent, ls_options);
+	if (color != NULL) {
+		lineAppend(printer, color, strlen(color));
+	}
+
+	if ((final_name = getModifiedName(ent->name, ls_options)) != NULL) {
+		lineAppend(printer, final_name, strlen(final_name));
+		free(final_name);
+	} else {
+		lineAppend(printer, ent->name, strlen(ent->name));
+	}
+
+	if (color != NULL) {
+		lineAppend(printer, COLOR_RESET, strlen(COLOR_RESET));
+	}
+
+	if ((type_char = fileTypeChar(ent, ls_options)) != '\0') {
+		lineAppend(printer, &type_char, 1);
+	}
+
+	return used + nameWidth(ent, ls_options);
+}
+
+/* 
+ * Columns run down (ls -C) or across (--across), and every row goes
+ * out in a single write once it has been laid out.
+ */
+static void
+printColumns(Printer *printer)
+{
+	const ColumnWidths *widths = &printer->widths;
+	size_t ncols = 0;
+	size_t nlines = 0;
+	size_t r = 0;
+	size_t c = 0;
+	size_t idx = 0;
+	size_t next = 0;
+	int cell = widths->name;
+	int used = 0;
+
+	if (printer->ls_options->print_inode) {
+		cell += widths->inode + 1;
+	}
+	if (printer->ls_options->print_bsize) {
+		cell += widths->blocks + 1;
+	}
+
+	ncols = (size_t)(printer->term_width / (cell + COLUMN_GAP));
+	if (ncols == 0) {
+		ncols = 1;
+	}
+	if (ncols > printer->nrows) {
+		ncols = printer->nrows;
+	}
+
+	nlines = (printer->nrows + ncols - 1) / ncols;
+	if (!printer->ls_options->columns_across) {
+		/* drop columns that would be left empty going down */
+		ncols = (printer->nrows + nlines - 1) / nlines;
+	}
+
+	for (r = 0; r < nlines; r++) {
+		printer->line_len = 0;
+
+		for (c = 0; c < ncols; c++) {
+			if (printer->ls_options->columns_across) {
+				idx = r * ncols + c;
+				next = idx + 1;
+			} else {
+				idx = c * nlines + r;
+				next = idx + nlines;
+			}
+
+			if (idx >= printer->nrows) {
+				break;
+			}
+
+			used = appendCell(printer, &printer->rows[idx]);
+
+			if (c + 1 < ncols && next < printer->nrows) {
+				linePad(printer, cell + COLUMN_GAP - used);
+			}
+		}
+
+		lineAppend(printer, "\n", 1);
+		(void)fwrite(printer->line, 1, printer->line_len, printer->out);
+	}
+}
+
+void
+flushPrinter(Printer *printer)
+{
+	EntryFields fields;
+	size_t i = 0;
+
+	if (printer->nrows == 0) {
+		return;
 	}
 
-	printFileName(fts_ent, ls_options);
+	settleRows(printer);
 
-	if (ls_options->print_long_format && 
-	    S_ISLNK(fts_ent->fts_statp->st_mode)) {
-		if ((plen = readlink(fts_ent->fts_accpath, symlink_path,
-		    PATH_MAX)) == -1) {
-			perror("symlink traversal");
-		} else {
-			symlink_path[plen] = '\0';
-			printf(" -> %s", symlink_path);
+	if (columnMode(printer->ls_options)) {
+		printColumns(printer);
+	} else {
+		for (i = 0; i < printer->nrows; i++) {
+			loadFields(&fields, printer, &printer->rows[i]);
+			printListedFile(printer->out, &printer->rows[i].ent,
+			    &fields, &printer->widths, printer->ls_options);
 		}
 	}
 
-	printf("\n");
+	printer->nrows = 0;
+	printer->names_len = 0;
+	memset(&printer->widths, 0, sizeof(printer->widths));
+}
+
+/* 
+ * Only files with more than one link can be met twice, so only those
+ * are looked up; directories are left out since their link counts come
+ * from subdirectories. If the set cannot grow, a file is counted again
+ * rather than failing the listing.
+ */
+static void
+tallyEntry(Printer *printer, const LsEntry *ent)
+{
+	const struct stat *sb = ent->statp;
+
+	if (ent->kind != ENTRY_FILE || sb == NULL ||
+	    isDirHeader(ent, printer->ls_options)) {
+		return;
+	}
+
+	if (sb->st_nlink > 1 && !S_ISDIR(sb->st_mode) &&
+	    linkSeen(&printer->links, sb->st_dev, sb->st_ino) == 1) {
+		++printer->total_repeats;
+		return;
+	}
+
+	printer->total_blocks += (uint64_t)sb->st_blocks;
+	printer->total_bytes += (uint64_t)sb->st_size;
+	++printer->total_files;
+}
+
+/* the grand total, in the same units as -s */
+void
+printTotals(Printer *printer)
+{
+	char blocks[FIELD_LEN];
+	char bytes[FIELD_LEN];
+	char files[FIELD_LEN];
+	char repeats[FIELD_LEN];
+
+	if (!printer->ls_options->dedup_links) {
+		return;
+	}
+
+	formatBlockSize(blocks, sizeof(blocks), printer->total_blocks,
+	    printer->user_bsize, printer->ls_options);
+	formatCount(bytes, sizeof(bytes), printer->total_bytes);
+	formatCount(files, sizeof(files), printer->total_files);
+	formatCount(repeats, sizeof(repeats), printer->total_repeats);
+	(void)fprintf(printer->out, "total %s (%s bytes in %s files, "
+	    "%s repeated links)\n", blocks, bytes, files, repeats);
+}
+
+/* 
+ * Entries are held back until their directory's group is complete, so
+ * that widths are known before anything is printed. Groups end at a
+ * change of level or at anything that is not a plain listed file, and
+ * after GROUP_ROWS entries, so that a huge directory is not held in
+ * memory and every run of a listing breaks it at the same rows.
+ */
+void
+printerAdd(Printer *printer, const LsEntry *ent)
+{
+	EntryFields fields;
+
+	if (printer->ls_options->dedup_links) {
+		tallyEntry(printer, ent);
+	}
+
+	if (!printer->buffered || ent->kind != ENTRY_FILE ||
+	    isDirHeader(ent, printer->ls_options)) {
+		flushPrinter(printer);
+		printEntry(printer->out, ent, printer->user_bsize, 
+		    printer->ls_options);
+		return;
+	}
+
+	if (ent->level != printer->level) {
+		flushPrinter(printer);
+		printer->level = ent->level;
+	}
+
+	fillFields(&fields, ent, printer->user_bsize, printer->ls_options);
+
+	if (addRow(printer, ent, &fields) != 0) {
+		/* out of memory, so print what we have and go unaligned */
+		flushPrinter(printer);
+		printListedFile(printer->out, ent, &fields, &legacy_widths,
+		    printer->ls_options);
+		return;
+	}
+
+	updateWidths(printer, ent, &fields);
+
+	if (printer->nrows >= GROUP_ROWS) {
+		flushPrinter(printer);
+	}
+}
+
+void
+freePrinter(Printer *printer)
+{
+	free(printer->rows);
+	free(printer->names);
+	free(printer->line);
+	freeLinkSet(&printer->links);
+	printer->rows = NULL;
+	printer->names = NULL;
+	printer->line = NULL;
+}
+
+static int
+emitToStream(EntrySink *sink, const LsEntry *ent)
+{
+	PrintSink *psink = sink->state;
+
+	/* stop the walk once the reader has gone away */
+	if (ferror(psink->printer.out)) {
+		errno = EIO;
+		return -1;
+	}
+
+	printerAdd(&psink->printer, ent);
+
+	return 0;
+}
+
+static int
+syncStream(EntrySink *sink, off_t *offset)
+{
+	PrintSink *psink = sink->state;
+	FILE *out = psink->printer.out;
+
+	flushPrinter(&psink->printer);
+
+	if (fflush(out) != 0 || fsync(fileno(out)) != 0 ||
+	    (*offset = ftello(out)) == -1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static size_t
+pendingStream(EntrySink *sink)
+{
+	PrintSink *psink = sink->state;
+
+	return psink->printer.nrows;
+}
+
+void
+initPrintSink(PrintSink *psink, FILE *out, const Options *ls_options)
+{
+	psink->sink.emit = emitToStream;
+	psink->sink.sync = syncStream;
+	psink->sink.pending = pendingStream;
+	psink->sink.state = psink;
+	initPrinter(&psink->printer, out, ls_options);
+}
+
+void
+finishPrintSink(PrintSink *psink)
+{
+	flushPrinter(&psink->printer);
+	printTotals(&psink->printer);
+	freePrinter(&psink->printer);
 }
@@ -37,10 +37,68 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sys/stat.h>
 
 #include <fts.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #include "helpers.h"
+#include "linkset.h"
 
-void printEntry(FTSENT *fts_ent, long int user_bsize, 
+typedef struct ColumnWidths {
+	int inode;
+	int blocks;
+	int nlink;
+	int user;
+	int group;
+	int size;
+	int name;
+} ColumnWidths;
+
+typedef struct TableRow TableRow;
+
+/* 
+ * Formats entries onto a stream. Unless output is plain names one per
+ * line, entries are buffered a directory at a time, up to a few
+ * thousand, so that columns can be sized from widths gathered as each
+ * entry arrives.
+ */
+typedef struct Printer {
+	FILE *out;
+	long user_bsize;
+	const Options *ls_options;
+	int buffered;
+	int term_width;
+	short level;
+	TableRow *rows;
+	size_t nrows;
+	size_t rows_cap;
+	char *names;
+	size_t names_len;
+	size_t names_cap;
+	char *line;
+	size_t line_len;
+	size_t line_cap;
+	ColumnWidths widths;
+	LinkSet links;		/* files with several links, by --dedup-links */
+	uint64_t total_blocks;	/* 64-bit even where long is not */
+	uint64_t total_bytes;
+	uint64_t total_files;
+	uint64_t total_repeats;
+} Printer;
+
+/* sink that formats each entry straight onto a stream */
+typedef struct PrintSink {
+	EntrySink sink;
+	Printer printer;
+} PrintSink;
+
+LS_PUBLIC void printEntry(FILE *out, const LsEntry *ent, long int user_bsize, 
 		const Options *ls_options);
+void initPrinter(Printer *, FILE *, const Options *);
+void printerAdd(Printer *, const LsEntry *);
+void flushPrinter(Printer *);
+void printTotals(Printer *);
+void freePrinter(Printer *);
+void initPrintSink(PrintSink *, FILE *, const Options *);
+void finishPrintSink(PrintSink *);
 
 #endif /* LS_PRINT_H */
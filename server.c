@@ -0,0 +1,735 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+/*
+ * Persistent listing server. A client hands over its stdout, stderr
+ * and working directory as descriptors along with its argument vector,
+ * and the server lists straight into the client's stdout before
+ * replying with an exit status. Staying resident keeps user and group
+ * names, timezone data and recently listed directories warm between
+ * requests, which a fresh process has to rebuild every time.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "color.h"
+#include "helpers.h"
+#include "internal.h"
+#include "server.h"
+
+#define REQUEST_MAGIC 0x6c735231	/* "lsR1" */
+#define REQUEST_FDS 3
+#define MAX_REQUEST_LEN (256 * 1024)
+#define DIR_CACHE_SLOTS 64
+#define TZ_CACHE_LEN 256
+
+typedef struct RequestHeader {
+	uint32_t magic;
+	uint32_t length;	/* bytes of string data that follow */
+	uint32_t argc;
+	uint32_t envc;
+} RequestHeader;
+
+typedef struct DirCacheSlot {
+	dev_t dev;
+	ino_t ino;
+	int fd;
+	unsigned long last_use;
+} DirCacheSlot;
+
+/* environment that changes output and so travels with each request */
+static const char *forward_env[] = {
+	"BLOCKSIZE", "COLUMNS", "LS_COLORS", "TZ", NULL
+};
+
+static DirCacheSlot dir_cache[DIR_CACHE_SLOTS];
+static unsigned long dir_clock = 0;
+static char cached_tz[TZ_CACHE_LEN];
+static int tz_was_set = 0;
+
+static int
+readFully(int fd, void *buf, size_t len)
+{
+	char *pos = buf;
+	ssize_t got = 0;
+
+	while (len > 0) {
+		if ((got = read(fd, pos, len)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		} else if (got == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		pos += got;
+		len -= (size_t)got;
+	}
+
+	return 0;
+}
+
+static void
+initDirCache(void)
+{
+	int i = 0;
+
+	for (i = 0; i < DIR_CACHE_SLOTS; i++) {
+		dir_cache[i].fd = -1;
+		dir_cache[i].last_use = 0;
+	}
+}
+
+/* 
+ * Holding a directory open keeps its vnode referenced, so the kernel
+ * is far less inclined to evict it and its attributes between
+ * requests. Slots are reused least-recently-listed first.
+ */
+static void
+pinDirectory(int dir_fd)
+{
+	struct stat sb;
+	DirCacheSlot *victim = &dir_cache[0];
+	int i = 0;
+
+	if (fstat(dir_fd, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+		return;
+	}
+
+	++dir_clock;
+	for (i = 0; i < DIR_CACHE_SLOTS; i++) {
+		if (dir_cache[i].fd != -1 && dir_cache[i].dev == sb.st_dev &&
+		    dir_cache[i].ino == sb.st_ino) {
+			dir_cache[i].last_use = dir_clock;
+			return;
+		}
+
+		if (dir_cache[i].last_use < victim->last_use) {
+			victim = &dir_cache[i];
+		}
+	}
+
+	if (victim->fd != -1) {
+		(void)close(victim->fd);
+	}
+
+	victim->dev = sb.st_dev;
+	victim->ino = sb.st_ino;
+	victim->last_use = dir_clock;
+	victim->fd = dup(dir_fd);
+}
+
+/* 
+ * Only directories are pinned. Opening a device node can rewind a
+ * tape or the like, so anything else is never opened at all.
+ */
+static void
+pinTargets(char **targets)
+{
+	struct stat sb;
+	int fd = -1;
+
+	for (; *targets != NULL; targets++) {
+		if (lstat(*targets, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+			continue;
+		}
+
+		if ((fd = open(*targets, O_RDONLY | O_DIRECTORY | 
+		    O_NOFOLLOW)) == -1) {
+			continue;
+		}
+		pinDirectory(fd);
+		(void)close(fd);
+	}
+}
+
+static const char *
+findEnv(char **env, uint32_t envc, const char *name)
+{
+	size_t len = strlen(name);
+	uint32_t i = 0;
+
+	for (i = 0; i < envc; i++) {
+		if (strncmp(env[i], name, len) == 0 && env[i][len] == '=') {
+			return env[i] + len + 1;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+applyEnvironment(char **env, uint32_t envc)
+{
+	const char *value = NULL;
+	const char *tz = NULL;
+	int i = 0;
+
+	for (i = 0; forward_env[i] != NULL; i++) {
+		if ((value = findEnv(env, envc, forward_env[i])) != NULL) {
+			(void)setenv(forward_env[i], value, 1);
+		} else {
+			(void)unsetenv(forward_env[i]);
+		}
+	}
+
+	/* only reparse zone data when a client asks for a different zone */
+	tz = getenv("TZ");
+	if ((tz == NULL && tz_was_set) || 
+	    (tz != NULL && (!tz_was_set || strcmp(tz, cached_tz) != 0))) {
+		tzset();
+		tz_was_set = (tz != NULL);
+		if (tz != NULL) {
+			(void)strlcpy(cached_tz, tz, TZ_CACHE_LEN);
+		}
+	}
+}
+
+/* close whatever descriptors a rejected message carried */
+static void
+closePassed(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg = NULL;
+	const unsigned char *data = NULL;
+	size_t nfds = 0;
+	size_t i = 0;
+	int fd = -1;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; 
+	    cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || 
+		    cmsg->cmsg_type != SCM_RIGHTS ||
+		    cmsg->cmsg_len < CMSG_LEN(0)) {
+			continue;
+		}
+
+		data = CMSG_DATA(cmsg);
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < nfds; i++) {
+			memcpy(&fd, data + i * sizeof(int), sizeof(int));
+			(void)close(fd);
+		}
+	}
+}
+
+/* pull the header and passed descriptors off a fresh connection */
+static int
+receiveHeader(int conn, RequestHeader *hdr, int *fds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg = NULL;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(REQUEST_FDS * sizeof(int))];
+	} control;
+	ssize_t got = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = hdr;
+	iov.iov_len = sizeof(*hdr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	while ((got = recvmsg(conn, &msg, 0)) == -1 && errno == EINTR) {
+		continue;
+	}
+
+	if (got == -1) {
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS || 
+	    cmsg->cmsg_len != CMSG_LEN(REQUEST_FDS * sizeof(int))) {
+		/* they would otherwise stay open for the life of the server */
+		closePassed(&msg);
+		errno = EBADMSG;
+		return -1;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), REQUEST_FDS * sizeof(int));
+
+	/* descriptors are ours now, so finish the header the slow way */
+	if ((size_t)got < sizeof(*hdr) && readFully(conn, 
+	    (char *)hdr + got, sizeof(*hdr) - (size_t)got) != 0) {
+		return -1;
+	}
+
+	if (hdr->magic != REQUEST_MAGIC || hdr->length > MAX_REQUEST_LEN) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* split the NUL-separated payload into environment and arguments */
+static char **
+unpackStrings(char *payload, const RequestHeader *hdr)
+{
+	char **strings = NULL;
+	char *pos = payload;
+	char *end = payload + hdr->length;
+	uint32_t count = hdr->envc + hdr->argc;
+	uint32_t i = 0;
+
+	if (count == 0 || count > hdr->length) {
+		return NULL;
+	}
+
+	if ((strings = calloc((size_t)count + 2, sizeof(*strings))) == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (pos >= end || memchr(pos, '\0', (size_t)(end - pos)) == NULL) {
+			free(strings);
+			return NULL;
+		}
+		/* leave room to slide in argv[0] after the environment */
+		strings[i < hdr->envc ? i : i + 1] = pos;
+		pos += strlen(pos) + 1;
+	}
+
+	return strings;
+}
+
+static int
+listForClient(int argc, char **argv, int out_fd)
+{
+	int first_target = 0;
+	char *local_default[2] = {".", NULL};
+	char **file_targets = NULL;
+	FILE *out = NULL;
+	Options req_options;
+	Throttle throttle;
+	int status = EXIT_SUCCESS;
+
+	setDefaultOptions(&req_options);
+	req_options.mark_nonprinting = isatty(out_fd) ? 1 : 0;
+	req_options.print_columns = req_options.mark_nonprinting;
+
+	if ((first_target = parseOptions(argc, argv, &req_options)) < 0) {
+		fprintf(stderr, "usage: %s [-%s] [file...]\n", getprogname(),
+		    LS_OPTION_CHARS);
+		return EXIT_FAILURE;
+	}
+
+	if (req_options.server_socket != NULL) {
+		fprintf(stderr, "%s: --server is not valid in a request\n",
+		    getprogname());
+		return EXIT_FAILURE;
+	}
+
+	/* demoting would outlast the request and slow every later client */
+	if (req_options.idle_priority) {
+		fprintf(stderr, "%s: --idle is not valid in a request\n",
+		    getprogname());
+		return EXIT_FAILURE;
+	}
+
+	/* files named by a client must not be opened with our rights */
+	if (req_options.snapshot_file != NULL || 
+	    req_options.diff_file != NULL ||
+	    req_options.checkpoint_file != NULL) {
+		fprintf(stderr, "%s: --snapshot, --diff and --checkpoint are "
+		    "not valid in a request\n", getprogname());
+		return EXIT_FAILURE;
+	}
+
+	if (req_options.color_output == COLOR_AUTO) {
+		req_options.color_output = isatty(out_fd) ? 
+		    COLOR_ALWAYS : COLOR_NEVER;
+	}
+
+	/* only recompiled when a client sends a different LS_COLORS */
+	if (req_options.color_output == COLOR_ALWAYS &&
+	    loadColors(getenv("LS_COLORS")) != 0) {
+		req_options.color_output = COLOR_NEVER;
+	}
+
+	argc -= first_target;
+	argv += first_target;
+
+	if (argc > 1) {
+		req_options.show_dir_header = 1;
+	}
+
+	normalizeDirNames(argc, argv);
+
+	file_targets = argv;
+	if (argc == 0) {
+		file_targets = local_default;
+	}
+
+	pinTargets(file_targets);
+
+	if ((out = fdopen(out_fd, "w")) == NULL) {
+		perror("client output");
+		(void)close(out_fd);
+		return EXIT_FAILURE;
+	}
+
+	initThrottle(&throttle, req_options.gentle_stats,
+	    req_options.gentle_dirs);
+
+	if (listDirectory(file_targets, &req_options, out, &throttle) != 0) {
+		status = EXIT_FAILURE;
+	}
+
+	/* stderr is the client's for the length of the request */
+	reportThrottle(&throttle, stderr);
+
+	if (fclose(out) != 0) {
+		status = EXIT_FAILURE;
+	}
+
+	return status;
+}
+
+static void
+serveRequest(int conn, int home_fd)
+{
+	RequestHeader hdr;
+	int fds[REQUEST_FDS] = {-1, -1, -1};
+	int saved_err = -1;
+	char *payload = NULL;
+	char **strings = NULL;
+	int32_t status = EXIT_FAILURE;
+
+	if (receiveHeader(conn, &hdr, fds) != 0) {
+		perror("bad request");
+		goto done;
+	}
+
+	if ((payload = malloc((size_t)hdr.length + 1)) == NULL ||
+	    readFully(conn, payload, hdr.length) != 0) {
+		perror("read request");
+		goto done;
+	}
+	payload[hdr.length] = '\0';
+
+	if ((strings = unpackStrings(payload, &hdr)) == NULL) {
+		fprintf(stderr, "%s: malformed request\n", getprogname());
+		goto done;
+	}
+	strings[hdr.envc] = (char *)getprogname();
+
+	applyEnvironment(strings, hdr.envc);
+
+	/* borrow the client's stderr and cwd for the length of the request */
+	if ((saved_err = dup(STDERR_FILENO)) == -1 ||
+	    dup2(fds[1], STDERR_FILENO) == -1) {
+		perror("client stderr");
+		goto done;
+	}
+
+	if (fchdir(fds[2]) != 0) {
+		perror("client cwd");
+	} else {
+		pinDirectory(fds[2]);
+		status = listForClient((int)hdr.argc + 1, strings + hdr.envc,
+		    fds[0]);
+		/* listForClient always takes ownership of the output */
+		fds[0] = -1;
+	}
+
+	(void)fflush(stderr);
+	(void)dup2(saved_err, STDERR_FILENO);
+	(void)fchdir(home_fd);
+
+	if (writeFully(conn, &status, sizeof(status)) != 0) {
+		perror("send status");
+	}
+
+done:
+	if (saved_err != -1) {
+		(void)close(saved_err);
+	}
+	if (fds[0] != -1) {
+		(void)close(fds[0]);
+	}
+	if (fds[1] != -1) {
+		(void)close(fds[1]);
+	}
+	if (fds[2] != -1) {
+		(void)close(fds[2]);
+	}
+	free(strings);
+	free(payload);
+}
+
+/* only the user running the server may have it list for them */
+static int
+peerAllowed(int conn)
+{
+	uid_t uid = 0;
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+		return 0;
+	}
+	uid = cred.uid;
+#else
+	gid_t gid = 0;
+
+	if (getpeereid(conn, &uid, &gid) != 0) {
+		return 0;
+	}
+#endif
+
+	return uid == geteuid();
+}
+
+static int
+fillSocketAddr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (strlcpy(addr->sun_path, path, sizeof(addr->sun_path)) >= 
+	    sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+runServer(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat sb;
+	mode_t old_mask = 0;
+	int32_t refused = EXIT_FAILURE;
+	int listen_fd = -1;
+	int conn = -1;
+	int home_fd = -1;
+	int bound = -1;
+
+	/* a client that goes away mid-listing must not take us with it */
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	/* zone data is loaded once here, and again only if TZ changes */
+	tzset();
+	initDirCache();
+
+	if ((home_fd = open(".", O_RDONLY)) == -1) {
+		perror("open cwd");
+		return EXIT_FAILURE;
+	}
+
+	if (fillSocketAddr(&addr, path) != 0) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	/* clear out a stale socket, but never anything else */
+	if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+		(void)unlink(path);
+	}
+
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	/* the socket is created owner-only, with no window in between */
+	old_mask = umask(S_IRWXG | S_IRWXO);
+	bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+	(void)umask(old_mask);
+
+	if (bound != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	for (;;) {
+		if ((conn = accept(listen_fd, NULL, NULL)) == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			perror("accept");
+			break;
+		}
+
+		if (!peerAllowed(conn)) {
+			fprintf(stderr, "%s: refused request from another "
+			    "user\n", getprogname());
+			(void)writeFully(conn, &refused, sizeof(refused));
+			(void)close(conn);
+			continue;
+		}
+
+		serveRequest(conn, home_fd);
+		(void)close(conn);
+	}
+
+	(void)close(listen_fd);
+	(void)close(home_fd);
+
+	return EXIT_FAILURE;
+}
+
+int
+runClient(const char *path, int argc, char **argv)
+{
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct iovec iov[2];
+	struct cmsghdr *cmsg = NULL;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(REQUEST_FDS * sizeof(int))];
+	} control;
+	RequestHeader hdr;
+	char *payload = NULL;
+	char *pos = NULL;
+	const char *value = NULL;
+	size_t len = 0;
+	int fds[REQUEST_FDS];
+	int sock = -1;
+	int i = 0;
+	int32_t status = EXIT_FAILURE;
+
+	/* a refused request is closed early, which is an error, not a kill */
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	hdr.magic = REQUEST_MAGIC;
+	hdr.argc = 0;
+	hdr.envc = 0;
+
+	for (i = 0; forward_env[i] != NULL; i++) {
+		if ((value = getenv(forward_env[i])) != NULL) {
+			len += strlen(forward_env[i]) + strlen(value) + 2;
+		}
+	}
+	for (i = 1; i < argc; i++) {
+		len += strlen(argv[i]) + 1;
+	}
+
+	if (len > MAX_REQUEST_LEN) {
+		fprintf(stderr, "%s: request too large\n", getprogname());
+		return EXIT_FAILURE;
+	}
+
+	if ((payload = malloc(len + 1)) == NULL) {
+		perror("build request");
+		return EXIT_FAILURE;
+	}
+
+	pos = payload;
+	for (i = 0; forward_env[i] != NULL; i++) {
+		if ((value = getenv(forward_env[i])) != NULL) {
+			pos += sprintf(pos, "%s=%s", forward_env[i], value) + 1;
+			hdr.envc++;
+		}
+	}
+	for (i = 1; i < argc; i++) {
+		pos += sprintf(pos, "%s", argv[i]) + 1;
+		hdr.argc++;
+	}
+	hdr.length = (uint32_t)len;
+
+	fds[0] = STDOUT_FILENO;
+	fds[1] = STDERR_FILENO;
+	if ((fds[2] = open(".", O_RDONLY)) == -1) {
+		perror("open cwd");
+		free(payload);
+		return EXIT_FAILURE;
+	}
+
+	if (fillSocketAddr(&addr, path) != 0 ||
+	    (sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		perror(path);
+		goto done;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = payload;
+	iov[1].iov_len = len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(REQUEST_FDS * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(sock, &msg, 0) != (ssize_t)(sizeof(hdr) + len)) {
+		perror("send request");
+		goto done;
+	}
+
+	if (readFully(sock, &status, sizeof(status)) != 0) {
+		perror("read status");
+		status = EXIT_FAILURE;
+	}
+
+done:
+	if (sock != -1) {
+		(void)close(sock);
+	}
+	(void)close(fds[2]);
+	free(payload);
+
+	return (int)status;
+}
@@ -0,0 +1,648 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+/*
+ * Binary tree snapshots and diffs against them. A snapshot is a header,
+ * an array of fixed-size records and a table of NUL-terminated paths.
+ * Records are stored in traversal order, which with siblings sorted by
+ * name is the same as sorting full paths with '/' below every other
+ * character. That lets a diff walk the live tree and the mapped file
+ * side by side in one merge pass. Each directory record also counts
+ * the records beneath it, so a removed subtree is passed over at once.
+ *
+ * A directory whose mtime still matches holds the same names, so the
+ * diff does not read it again: its recorded entries are lstat'ed by
+ * path instead, and only a subdirectory whose own names have changed
+ * is handed back to fts. Every file is still compared, since rewriting
+ * one in place leaves its directory's mtime alone.
+ *
+ * Snapshots use the host's byte order and are not meant to be moved
+ * between machines.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "snapshot.h"
+
+#define SNAP_MAGIC 0x6c735331	/* "lsS1" */
+#define SNAP_VERSION 2
+#define TMP_SUFFIX ".tmp"
+
+typedef struct SnapHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t nrecords;
+	uint64_t strings_off;
+	uint64_t strings_len;
+} SnapHeader;
+
+typedef struct SnapRecord {
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	uint64_t path_off;	/* into the string table */
+	uint32_t mode;
+	uint32_t subtree;	/* records below this one, directories only */
+} SnapRecord;
+
+typedef struct SnapWriter {
+	SnapRecord *records;
+	size_t nrecords;
+	size_t records_cap;
+	char *strings;
+	size_t strings_len;
+	size_t strings_cap;
+} SnapWriter;
+
+/* read-only view of a mapped snapshot */
+typedef struct SnapView {
+	const SnapRecord *records;
+	size_t nrecords;
+	const char *strings;
+	size_t strings_len;
+} SnapView;
+
+typedef struct DiffState {
+	const SnapView *view;
+	const Options *ls_options;
+	FILE *out;
+	Throttle *throttle;
+} DiffState;
+
+/* compare paths as if '/' sorted below every other character */
+static int
+pathCompare(const char *a, const char *b)
+{
+	int ca = 0;
+	int cb = 0;
+
+	for (;; a++, b++) {
+		ca = *a == '\0' ? -1 : (*a == '/' ? 0 : (unsigned char)*a);
+		cb = *b == '\0' ? -1 : (*b == '/' ? 0 : (unsigned char)*b);
+
+		if (ca != cb) {
+			return ca < cb ? -1 : 1;
+		} else if (ca == -1) {
+			return 0;
+		}
+	}
+}
+
+static int
+nameOrder(const FTSENT **a, const FTSENT **b)
+{
+	return pathCompare((*a)->fts_name, (*b)->fts_name);
+}
+
+static FTS *
+openTree(char **targets, const Options *ls_options, int fts_options)
+{
+	fts_options |= FTS_PHYSICAL | FTS_NOCHDIR;
+
+	if (ls_options->one_file_system) {
+		fts_options |= FTS_XDEV;
+	}
+
+	return fts_open(targets, fts_options, nameOrder);
+}
+
+static void
+reportEntry(const FTSENT *ent)
+{
+	fprintf(stderr, "%s: %s: %s\n", getprogname(), ent->fts_path,
+	    strerror(ent->fts_errno));
+}
+
+static int64_t
+mtimeNsec(const struct stat *sb)
+{
+	return (int64_t)sb->st_mtim.tv_sec * NSEC_PER_SEC + 
+	    sb->st_mtim.tv_nsec;
+}
+
+static int64_t
+ctimeNsec(const struct stat *sb)
+{
+	return (int64_t)sb->st_ctim.tv_sec * NSEC_PER_SEC + 
+	    sb->st_ctim.tv_nsec;
+}
+
+static int
+addRecord(SnapWriter *writer, const FTSENT *ent)
+{
+	SnapRecord *rec = NULL;
+	size_t len = ent->fts_pathlen + 1;
+
+	if (growBuffer(&writer->records, &writer->records_cap, 
+	    writer->nrecords + 1, sizeof(*writer->records)) != 0 ||
+	    growBuffer(&writer->strings, &writer->strings_cap,
+	    writer->strings_len + len, 1) != 0) {
+		return -1;
+	}
+
+	rec = &writer->records[writer->nrecords++];
+	memset(rec, 0, sizeof(*rec));
+	rec->ino = (uint64_t)ent->fts_statp->st_ino;
+	rec->size = (uint64_t)ent->fts_statp->st_size;
+	rec->mtime_ns = mtimeNsec(ent->fts_statp);
+	rec->ctime_ns = ctimeNsec(ent->fts_statp);
+	rec->mode = (uint32_t)ent->fts_statp->st_mode;
+	rec->path_off = writer->strings_len;
+
+	memcpy(writer->strings + writer->strings_len, ent->fts_path, len);
+	writer->strings_len += len;
+
+	return 0;
+}
+
+/* written under a temporary name and renamed, so no reader sees half */
+static int
+saveSnapshot(const SnapWriter *writer, const char *path)
+{
+	SnapHeader header;
+	char tmp_path[PATH_MAX];
+	FILE *snap = NULL;
+	int saved_errno = 0;
+	int status = 0;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = SNAP_MAGIC;
+	header.version = SNAP_VERSION;
+	header.nrecords = writer->nrecords;
+	header.strings_off = sizeof(header) + 
+	    writer->nrecords * sizeof(*writer->records);
+	header.strings_len = writer->strings_len;
+
+	if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s%s", path, 
+	    TMP_SUFFIX) >= sizeof(tmp_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if ((snap = fopen(tmp_path, "wb")) == NULL) {
+		return -1;
+	}
+
+	if (fwrite(&header, sizeof(header), 1, snap) != 1 ||
+	    fwrite(writer->records, sizeof(*writer->records), 
+	    writer->nrecords, snap) != writer->nrecords ||
+	    fwrite(writer->strings, 1, writer->strings_len, snap) != 
+	    writer->strings_len) {
+		status = -1;
+	}
+
+	if (status == 0 && (fflush(snap) != 0 || fsync(fileno(snap)) != 0)) {
+		status = -1;
+	}
+
+	saved_errno = errno;
+	if (fclose(snap) != 0 && status == 0) {
+		saved_errno = errno;
+		status = -1;
+	}
+
+	if (status == 0 && rename(tmp_path, path) != 0) {
+		saved_errno = errno;
+		status = -1;
+	}
+
+	if (status != 0) {
+		(void)unlink(tmp_path);
+		errno = saved_errno;
+	}
+
+	return status;
+}
+
+/* returns 0, or -1 with errno set */
+int
+writeSnapshot(char **targets, const Options *ls_options, const char *path,
+		Throttle *throttle)
+{
+	SnapWriter writer;
+	FTS *fts = NULL;
+	FTSENT *ent = NULL;
+	size_t idx = 0;
+	int status = 0;
+
+	memset(&writer, 0, sizeof(writer));
+
+	if ((fts = openTree(targets, ls_options, 0)) == NULL) {
+		return -1;
+	}
+
+	errno = 0;
+	while ((ent = fts_read(fts)) != NULL) {
+		switch (ent->fts_info) {
+		case FTS_DP:
+			/* close off the count of records under this directory */
+			idx = (size_t)ent->fts_number;
+			writer.records[idx].subtree = 
+			    (uint32_t)(writer.nrecords - idx - 1);
+			continue;
+		case FTS_ERR:
+		case FTS_NS:
+		case FTS_DNR:
+			/* an unreadable directory was recorded as FTS_D already */
+			reportEntry(ent);
+			continue;
+		default:
+			break;
+		}
+
+		throttleStats(throttle, 1);
+		if (ent->fts_info == FTS_D) {
+			throttleDir(throttle);
+		}
+
+		ent->fts_number = (long)writer.nrecords;
+		if (addRecord(&writer, ent) != 0) {
+			status = -1;
+			break;
+		}
+	}
+
+	if (status == 0 && errno != 0 && ent == NULL) {
+		status = -1;
+	}
+
+	(void)fts_close(fts);
+
+	if (status == 0) {
+		status = saveSnapshot(&writer, path);
+	}
+
+	free(writer.records);
+	free(writer.strings);
+
+	return status;
+}
+
+static const char *
+recordPath(const SnapView *view, size_t idx)
+{
+	uint64_t off = view->records[idx].path_off;
+
+	return off < view->strings_len ? view->strings + off : NULL;
+}
+
+/* index just past a record and everything recorded beneath it */
+static size_t
+skipRecord(const SnapView *view, size_t idx)
+{
+	size_t next = idx + 1 + view->records[idx].subtree;
+
+	return next > view->nrecords ? view->nrecords : next;
+}
+
+static int
+mapSnapshot(const char *path, SnapView *view, void **map, size_t *map_len)
+{
+	const SnapHeader *header = NULL;
+	struct stat sb;
+	int fd = -1;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		return -1;
+	}
+
+	if (fstat(fd, &sb) == -1) {
+		(void)close(fd);
+		return -1;
+	}
+
+	if ((size_t)sb.st_size < sizeof(*header)) {
+		(void)close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	*map_len = (size_t)sb.st_size;
+	*map = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+
+	if (*map == MAP_FAILED) {
+		return -1;
+	}
+
+	/* the string table ends the file and must end in a terminator */
+	header = *map;
+	if (header->magic != SNAP_MAGIC || header->version != SNAP_VERSION ||
+	    header->nrecords > (*map_len - sizeof(*header)) / 
+	    sizeof(SnapRecord) ||
+	    header->strings_off != sizeof(*header) + 
+	    header->nrecords * sizeof(SnapRecord) ||
+	    header->strings_off + header->strings_len != *map_len ||
+	    (header->strings_len > 0 && 
+	    ((const char *)*map)[*map_len - 1] != '\0')) {
+		(void)munmap(*map, *map_len);
+		errno = EINVAL;
+		return -1;
+	}
+
+	view->records = (const SnapRecord *)(header + 1);
+	view->nrecords = header->nrecords;
+	view->strings = (const char *)*map + header->strings_off;
+	view->strings_len = header->strings_len;
+
+	return 0;
+}
+
+static int
+entryChanged(const SnapRecord *rec, const struct stat *sb)
+{
+	/* a directory's own size and times just reflect its entries */
+	if (S_ISDIR(sb->st_mode) && S_ISDIR(rec->mode)) {
+		return rec->ino != (uint64_t)sb->st_ino || 
+		    rec->mode != (uint32_t)sb->st_mode;
+	}
+
+	return rec->ino != (uint64_t)sb->st_ino || 
+	    rec->size != (uint64_t)sb->st_size ||
+	    rec->mtime_ns != mtimeNsec(sb) || 
+	    rec->ctime_ns != ctimeNsec(sb) || 
+	    rec->mode != (uint32_t)sb->st_mode;
+}
+
+/* a directory's mtime only moves when names are added or removed */
+static int
+sameNames(const SnapRecord *rec, const struct stat *sb)
+{
+	return S_ISDIR(rec->mode) && S_ISDIR(sb->st_mode) &&
+	    rec->ino == (uint64_t)sb->st_ino &&
+	    rec->mtime_ns == mtimeNsec(sb);
+}
+
+static int diffRange(DiffState *, char **, size_t, size_t);
+
+/* walk what lies under path afresh, against records [idx, end) */
+static int
+rewalk(DiffState *state, const char *path, size_t idx, size_t end)
+{
+	char *targets[2] = {NULL, NULL};
+	int status = 0;
+
+	if ((targets[0] = strdup(path)) == NULL) {
+		return -1;
+	}
+
+	status = diffRange(state, targets, idx, end);
+	free(targets[0]);
+
+	return status;
+}
+
+/* 
+ * The directory recorded at idx still holds the same names, so check
+ * what was recorded beneath it by path instead of reading it again.
+ * Records are in walk order, so a plain scan visits nested entries
+ * too, and only a subdirectory whose names changed needs fts.
+ */
+static int
+replayDirectory(DiffState *state, size_t idx, const struct stat *dir_sb)
+{
+	const SnapView *view = state->view;
+	const SnapRecord *rec = NULL;
+	const char *old_path = NULL;
+	size_t end = skipRecord(view, idx);
+	size_t next = 0;
+	struct stat sb;
+
+	for (idx++; idx < end; idx = next) {
+		rec = &view->records[idx];
+		next = idx + 1;
+
+		if ((old_path = recordPath(view, idx)) == NULL) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		/* only if something changed since the directory was checked */
+		throttleStats(state->throttle, 1);
+		if (lstat(old_path, &sb) == -1) {
+			if (errno == ENOENT || errno == ENOTDIR) {
+				fprintf(state->out, "D %s\n", old_path);
+			} else {
+				fprintf(stderr, "%s: %s: %s\n", getprogname(),
+				    old_path, strerror(errno));
+			}
+			next = skipRecord(view, idx);
+			continue;
+		}
+
+		/* stay off other file systems, as the snapshot did */
+		if (S_ISDIR(sb.st_mode) && !sameNames(rec, &sb) &&
+		    !(state->ls_options->one_file_system && 
+		    sb.st_dev != dir_sb->st_dev)) {
+			next = skipRecord(view, idx);
+			if (rewalk(state, old_path, idx, next) != 0) {
+				return -1;
+			}
+			continue;
+		}
+
+		if (entryChanged(rec, &sb)) {
+			fprintf(state->out, "M %s\n", old_path);
+		}
+	}
+
+	return 0;
+}
+
+/* 
+ * Merge a walk of targets against records [cursor, end), printing A,
+ * D or M for each added, removed or changed path. Added and removed
+ * directories are reported once rather than entry by entry. Returns 0,
+ * or -1 with errno set.
+ */
+static int
+diffRange(DiffState *state, char **targets, size_t cursor, size_t end)
+{
+	const SnapView *view = state->view;
+	struct stat sb;
+	const char *old_path = NULL;
+	FTS *fts = NULL;
+	FTSENT *ent = NULL;
+	int cmp = 0;
+	int status = 0;
+
+	if ((fts = openTree(targets, state->ls_options, FTS_NOSTAT)) == NULL) {
+		return -1;
+	}
+
+	errno = 0;
+	while (status == 0 && (ent = fts_read(fts)) != NULL) {
+		if (ent->fts_info == FTS_DP) {
+			continue;
+		}
+
+		/* a vanished operand is left for the records to report */
+		if (ent->fts_info == FTS_NS && ent->fts_errno == ENOENT) {
+			continue;
+		}
+
+		/* the second report of a directory already compared */
+		if (ent->fts_info == FTS_DNR) {
+			reportEntry(ent);
+			continue;
+		}
+
+		/* anything recorded that sorts first is gone */
+		cmp = 1;
+		while (cursor < end) {
+			if ((old_path = recordPath(view, cursor)) == NULL) {
+				errno = EINVAL;
+				status = -1;
+				break;
+			}
+
+			if ((cmp = pathCompare(old_path, ent->fts_path)) >= 0) {
+				break;
+			}
+
+			fprintf(state->out, "D %s\n", old_path);
+			cursor = skipRecord(view, cursor);
+			cmp = 1;
+		}
+
+		if (status != 0) {
+			break;
+		}
+
+		if (ent->fts_info == FTS_ERR || ent->fts_info == FTS_NS) {
+			/* no way to tell, so say nothing about this path */
+			reportEntry(ent);
+			if (cmp == 0) {
+				cursor = skipRecord(view, cursor);
+			}
+			continue;
+		}
+
+		if (cmp != 0) {
+			fprintf(state->out, "A %s\n", ent->fts_path);
+			if (ent->fts_info == FTS_D) {
+				(void)fts_set(fts, ent, FTS_SKIP);
+			}
+			continue;
+		}
+
+		/* with FTS_NOSTAT nothing is stat'ed for us, not even dirs */
+		throttleStats(state->throttle, 1);
+		if (lstat(ent->fts_accpath, &sb) == -1) {
+			fprintf(stderr, "%s: %s: %s\n", getprogname(),
+			    ent->fts_path, strerror(errno));
+			cursor = skipRecord(view, cursor);
+			if (ent->fts_info == FTS_D) {
+				(void)fts_set(fts, ent, FTS_SKIP);
+			}
+			continue;
+		}
+
+		if (entryChanged(&view->records[cursor], &sb)) {
+			fprintf(state->out, "M %s\n", ent->fts_path);
+		}
+
+		if (ent->fts_info == FTS_D && 
+		    sameNames(&view->records[cursor], &sb)) {
+			(void)fts_set(fts, ent, FTS_SKIP);
+			status = replayDirectory(state, cursor, &sb);
+			cursor = skipRecord(view, cursor);
+			continue;
+		}
+
+		/* fts goes on to read this one */
+		if (ent->fts_info == FTS_D) {
+			throttleDir(state->throttle);
+		}
+		++cursor;
+	}
+
+	if (status == 0 && ent == NULL && errno != 0) {
+		status = -1;
+	}
+
+	while (status == 0 && cursor < end) {
+		if ((old_path = recordPath(view, cursor)) == NULL) {
+			errno = EINVAL;
+			status = -1;
+			break;
+		}
+
+		fprintf(state->out, "D %s\n", old_path);
+		cursor = skipRecord(view, cursor);
+	}
+
+	(void)fts_close(fts);
+
+	return status;
+}
+
+/* returns 0, or -1 with errno set */
+int
+diffSnapshot(char **targets, const Options *ls_options, const char *path,
+		FILE *out, Throttle *throttle)
+{
+	SnapView view;
+	DiffState state;
+	void *map = NULL;
+	size_t map_len = 0;
+	int status = 0;
+
+	if (mapSnapshot(path, &view, &map, &map_len) != 0) {
+		return -1;
+	}
+
+	state.view = &view;
+	state.ls_options = ls_options;
+	state.out = out;
+	state.throttle = throttle;
+
+	status = diffRange(&state, targets, 0, view.nrecords);
+	(void)munmap(map, map_len);
+
+	return status;
+}
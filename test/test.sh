@@ -99,3 +99,151 @@ done
 # most useful when you have symlink loops to check termination
 echo "Running test: ls -lR /"
 timeout 60 ${MY_LS} -lR / > /dev/null 2>&1 || echo "ls -lR / failed"
+
+# the rest check features of this ls alone, in a scratch directory
+SCRATCH=`mktemp -d /tmp/ls_test.XXXXXX`
+
+echo "Running test: ls --snapshot / --diff"
+mkdir -p ${SCRATCH}/snap/d/sub
+echo a > ${SCRATCH}/snap/d/f
+echo b > ${SCRATCH}/snap/g
+${MY_LS} --snapshot=${SCRATCH}/snap.db ${SCRATCH}/snap || 
+    echo "ls --snapshot failed"
+OUT=`${MY_LS} --diff=${SCRATCH}/snap.db ${SCRATCH}/snap`
+[ -z "${OUT}" ] || echo "ls --diff of an unchanged tree failed"
+# same size and mtime, so only the ctime gives the rewrite away
+touch -r ${SCRATCH}/snap/g ${SCRATCH}/ref
+echo c > ${SCRATCH}/snap/g
+touch -r ${SCRATCH}/ref ${SCRATCH}/snap/g
+: > ${SCRATCH}/snap/d/sub/new
+OUT=`${MY_LS} --diff=${SCRATCH}/snap.db ${SCRATCH}/snap`
+[ "${OUT}" = "A ${SCRATCH}/snap/d/sub/new
+M ${SCRATCH}/snap/g" ] || echo "ls --diff of a changed tree failed"
+# an unreadable directory is reported once, not once per pass
+if [ `id -u` -ne 0 ]; then
+	mkdir ${SCRATCH}/snap/nr
+	${MY_LS} --snapshot=${SCRATCH}/snap.db ${SCRATCH}/snap
+	chmod 000 ${SCRATCH}/snap/nr
+	N=`${MY_LS} --diff=${SCRATCH}/snap.db ${SCRATCH}/snap 2>&1 | 
+	    grep -c nr`
+	[ "${N}" -eq 1 ] || echo "ls --diff of an unreadable dir failed"
+	chmod 755 ${SCRATCH}/snap/nr
+fi
+
+# a save must fall between groups, so -l output resumes unchanged
+echo "Running test: ls -lR --checkpoint --resume"
+for D in a b; do
+	for E in 0 1 2 3 4 5 6 7 8 9; do
+		mkdir -p ${SCRATCH}/tree/${D}${E}
+		for F in 0 1 2 3 4 5 6 7 8 9 10 11 12 13 14; do
+			for G in 0 1 2 3 4 5 6 7 8 9; do
+				: > ${SCRATCH}/tree/${D}${E}/f${F}${G}
+			done
+		done
+		head -c 100000 /dev/zero > ${SCRATCH}/tree/${D}${E}/zz
+	done
+done
+${MY_LS} -lR ${SCRATCH}/tree > ${TSYS}
+${MY_LS} -lR --gentle=200 --checkpoint=${SCRATCH}/ckpt ${SCRATCH}/tree \
+    >> ${TMINE}.ckpt 2>/dev/null &
+PID=$!
+sleep 12
+kill ${PID}
+wait ${PID} 2>/dev/null
+[ -f ${SCRATCH}/ckpt ] || echo "ls --checkpoint failed"
+${MY_LS} -lR --checkpoint=${SCRATCH}/ckpt --resume ${SCRATCH}/tree \
+    >> ${TMINE}.ckpt
+cmp -s ${TSYS} ${TMINE}.ckpt || echo "ls --resume failed"
+rm -f ${TMINE}.ckpt
+
+echo "Running test: ls --dedup-links"
+mkdir ${SCRATCH}/links
+head -c 1000 /dev/zero > ${SCRATCH}/links/f
+ln ${SCRATCH}/links/f ${SCRATCH}/links/g
+ln ${SCRATCH}/links/f ${SCRATCH}/links/h
+echo four > ${SCRATCH}/links/x
+${MY_LS} --dedup-links ${SCRATCH}/links | tail -1 | 
+    grep -q "(1005 bytes in 2 files, 2 repeated links)" || 
+    echo "ls --dedup-links failed"
+
+echo "Running test: ls --color=always with LS_COLORS"
+ESC=`printf '\033'`
+mkdir ${SCRATCH}/color
+: > ${SCRATCH}/color/a.txt
+ln -s a.txt ${SCRATCH}/color/ok
+ln -s nowhere ${SCRATCH}/color/orphan
+LS_COLORS='or=01;31:ln=01;36:*.txt=01;32' ${MY_LS} --color=always \
+    ${SCRATCH}/color > ${TMINE}
+grep -q "${ESC}\[01;32ma.txt${ESC}\[0m" ${TMINE} || 
+    echo "ls --color extension failed"
+grep -q "${ESC}\[01;36mok${ESC}\[0m" ${TMINE} || 
+    echo "ls --color symlink failed"
+grep -q "${ESC}\[01;31morphan${ESC}\[0m" ${TMINE} || 
+    echo "ls --color orphan failed"
+
+# five names of width 2 in 12 columns make three columns of two rows
+echo "Running test: ls -C / --across"
+mkdir ${SCRATCH}/cols
+for F in aa bb cc dd ee; do
+	: > ${SCRATCH}/cols/${F}
+done
+printf 'aa  cc  ee\nbb  dd\n' > ${TSYS}
+COLUMNS=12 ${MY_LS} -C ${SCRATCH}/cols > ${TMINE}
+cmp -s ${TSYS} ${TMINE} || echo "ls -C layout failed"
+printf 'aa  bb  cc\ndd  ee\n' > ${TSYS}
+COLUMNS=12 ${MY_LS} -C --across ${SCRATCH}/cols > ${TMINE}
+cmp -s ${TSYS} ${TMINE} || echo "ls --across layout failed"
+
+# with one path to a leaf, every probe sees the whole tree
+echo "Running test: ls --estimate"
+mkdir -p ${SCRATCH}/est/sub
+for F in 0 1 2 3 4 5 6 7 8 9; do
+	: > ${SCRATCH}/est/${F}
+done
+: > ${SCRATCH}/est/sub/a
+: > ${SCRATCH}/est/sub/b
+${MY_LS} --estimate=100,5 ${SCRATCH}/est > ${TMINE} || 
+    echo "ls --estimate failed"
+grep -q "^files  *12 +/- 0$" ${TMINE} || echo "ls --estimate files wrong"
+grep -q "^directories  *1 +/- 0$" ${TMINE} || 
+    echo "ls --estimate directories wrong"
+
+echo "Running test: ls --server / --client"
+${MY_LS} --server=${SCRATCH}/sock 2>/dev/null &
+SERVER=$!
+I=0
+while [ ! -S ${SCRATCH}/sock ] && [ ${I} -lt 50 ]; do
+	sleep 0.1
+	I=`expr ${I} + 1`
+done
+${MY_LS} -l ${SCRATCH}/snap > ${TSYS}
+${MY_LS} --client=${SCRATCH}/sock -l ${SCRATCH}/snap > ${TMINE} || 
+    echo "ls --client failed"
+cmp -s ${TSYS} ${TMINE} || echo "ls --client output differs"
+${MY_LS} --client=${SCRATCH}/sock --snapshot=${SCRATCH}/no.db \
+    ${SCRATCH}/snap > /dev/null 2>&1 && echo "ls --client status failed"
+# a reader that goes away must not keep the server walking
+${MY_LS} --client=${SCRATCH}/sock -lR / 2>/dev/null | head -1 > /dev/null
+timeout 5 ${MY_LS} --client=${SCRATCH}/sock ${SCRATCH}/snap > /dev/null ||
+    echo "ls --client after a closed pipe failed"
+kill ${SERVER}
+wait ${SERVER} 2>/dev/null
+
+# -x must neither list nor read what is mounted below the operand
+if [ `id -u` -eq 0 ] && mkdir -p ${SCRATCH}/xdev/mnt && 
+    mount -t tmpfs none ${SCRATCH}/xdev/mnt 2>/dev/null; then
+	echo "Running test: ls -R -x"
+	mkdir ${SCRATCH}/xdev/mnt/below
+	: > ${SCRATCH}/xdev/mnt/below/file
+	touch -a -t 200001010000 ${SCRATCH}/xdev/mnt
+	${MY_LS} -R -x ${SCRATCH}/xdev > ${TMINE}
+	grep -q below ${TMINE} && echo "ls -R -x listed a mount"
+	ls -ldu ${SCRATCH}/xdev/mnt | grep -q 2000 || 
+	    echo "ls -R -x read a mount"
+	${MY_LS} -R -x --inode-order ${SCRATCH}/xdev > /dev/null
+	ls -ldu ${SCRATCH}/xdev/mnt | grep -q 2000 || 
+	    echo "ls -R -x --inode-order read a mount"
+	umount ${SCRATCH}/xdev/mnt
+fi
+
+rm -rf ${SCRATCH}
@@ -0,0 +1,207 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+/*
+ * Rate limiting for --gentle. Stats and directory reads each draw on a
+ * token bucket. fts reads and stats a whole directory at once, so the
+ * walk is charged after the fact and sleeps off any debt before going
+ * further; over time the rates hold, while single bursts are bounded
+ * by the size of a directory.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sched.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "throttle.h"
+
+#define BURST_NSEC (NSEC_PER_SEC / 10)	/* debt tolerated before pausing */
+
+#ifdef __linux__
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#endif
+
+static uint64_t
+sinceStart(const Throttle *throttle)
+{
+	struct timespec now;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)(now.tv_sec - throttle->start.tv_sec) * NSEC_PER_SEC +
+	    (uint64_t)now.tv_nsec - (uint64_t)throttle->start.tv_nsec;
+}
+
+static void
+initLimit(RateLimit *limit, long rate)
+{
+	limit->interval = rate > 0 ? (uint64_t)(NSEC_PER_SEC / rate) : 0;
+	limit->due = 0;
+	limit->units = 0;
+}
+
+/* rates of zero or less leave that kind of work unlimited */
+void
+initThrottle(Throttle *throttle, long stats_rate, long dirs_rate)
+{
+	memset(throttle, 0, sizeof(*throttle));
+	initLimit(&throttle->stats, stats_rate);
+	initLimit(&throttle->dirs, dirs_rate);
+	throttle->enabled = stats_rate > 0 || dirs_rate > 0;
+	(void)clock_gettime(CLOCK_MONOTONIC, &throttle->start);
+}
+
+static void
+pauseFor(Throttle *throttle, uint64_t nsec)
+{
+	struct timespec wait;
+	uint64_t before = sinceStart(throttle);
+
+	wait.tv_sec = (time_t)(nsec / NSEC_PER_SEC);
+	wait.tv_nsec = (long)(nsec % NSEC_PER_SEC);
+
+	while (nanosleep(&wait, &wait) == -1 && errno == EINTR) {
+		continue;
+	}
+
+	throttle->slept += sinceStart(throttle) - before;
+	++throttle->pauses;
+}
+
+static void
+charge(Throttle *throttle, RateLimit *limit, unsigned long count)
+{
+	uint64_t now = 0;
+
+	limit->units += count;
+
+	if (limit->interval == 0) {
+		return;
+	}
+
+	/* an idle bucket refills, but only up to the burst allowance */
+	now = sinceStart(throttle);
+	if (limit->due < now) {
+		limit->due = now;
+	}
+	limit->due += count * limit->interval;
+
+	if (limit->due > now + BURST_NSEC) {
+		pauseFor(throttle, limit->due - now - BURST_NSEC);
+	}
+}
+
+void
+throttleStats(Throttle *throttle, unsigned long count)
+{
+	if (throttle->enabled) {
+		charge(throttle, &throttle->stats, count);
+	}
+}
+
+void
+throttleDir(Throttle *throttle)
+{
+	if (throttle->enabled) {
+		charge(throttle, &throttle->dirs, 1);
+	}
+}
+
+void
+reportThrottle(const Throttle *throttle, FILE *out)
+{
+	double total = (double)sinceStart(throttle) / NSEC_PER_SEC;
+	double slept = (double)throttle->slept / NSEC_PER_SEC;
+
+	if (!throttle->enabled) {
+		return;
+	}
+
+	fprintf(out, "%s: gentle: %lu stats, %lu dirs in %.2fs "
+	    "(%.0f stats/s, %.0f dirs/s); paused %lu times for %.2fs "
+	    "(%.0f%%)\n", getprogname(), throttle->stats.units,
+	    throttle->dirs.units, total,
+	    total > 0 ? throttle->stats.units / total : 0.0,
+	    total > 0 ? throttle->dirs.units / total : 0.0,
+	    throttle->pauses, slept, total > 0 ? 100.0 * slept / total : 0.0);
+}
+
+/* 
+ * Drop to idle I/O and CPU priority where the system has them, or to
+ * the lowest nice value otherwise. Returns 0, or -1 with errno set if
+ * nothing could be lowered.
+ */
+int
+demoteSelf(void)
+{
+	int demoted = 0;
+#if defined(__linux__) && defined(SCHED_IDLE)
+	struct sched_param param;
+#endif
+
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, 
+	    IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == 0) {
+		demoted = 1;
+	}
+#endif
+
+#if defined(__linux__) && defined(SCHED_IDLE)
+	memset(&param, 0, sizeof(param));
+	if (sched_setscheduler(0, SCHED_IDLE, &param) == 0) {
+		return 0;
+	}
+#endif
+
+	if (setpriority(PRIO_PROCESS, 0, PRIO_MAX) == 0 || demoted) {
+		return 0;
+	}
+
+	return -1;
+}
@@ -0,0 +1,63 @@
+/*
+
+BSD 3-Clause License
+
+Copyright (c) 2023, Thomas Allen
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef LS_THROTTLE_H
+#define LS_THROTTLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* one rate, as the time at which its bucket would next run dry */
+typedef struct RateLimit {
+	uint64_t interval;	/* nanoseconds per unit, 0 if unlimited */
+	uint64_t due;
+	unsigned long units;
+} RateLimit;
+
+typedef struct Throttle {
+	RateLimit stats;
+	RateLimit dirs;
+	struct timespec start;
+	uint64_t slept;
+	unsigned long pauses;
+	int enabled;
+} Throttle;
+
+void initThrottle(Throttle *, long, long);
+void throttleStats(Throttle *, unsigned long);
+void throttleDir(Throttle *);
+void reportThrottle(const Throttle *, FILE *);
+int demoteSelf(void);
+
+#endif /* LS_THROTTLE_H */